@@ -24,6 +24,8 @@ using namespace std;
 
 static uint32_t address = 0;
 static uint16_t port = 0;
+static int churn = 0;
+static unsigned long churned[2048];
 
 #if defined ( WIN32 )
 static DWORD CALLBACK ThreadTest(PVOID arg)
@@ -147,9 +149,67 @@ retry:
 	return(0);
 }
 
+/**
+  * @brief  连接风暴：反复连接、发送注册报文、立即断开
+  */
+#if defined ( WIN32 )
+static DWORD CALLBACK ThreadChurn(PVOID arg)
+#else
+static void *ThreadChurn(void *arg)
+#endif
+{
+#if defined ( _WIN32 )
+	WSADATA wsaData;
+	WSAStartup(MAKEWORD(2, 2), &wsaData);
+#endif
+	SOCKET sock;
+	SOCKADDR_IN addr;
+	char message[256];
+	unsigned long long index = (unsigned long long)arg;
+
+	addr.sin_family = AF_INET;
+#if defined ( _WIN32 )
+	addr.sin_addr.S_un.S_addr = address;
+#elif defined ( __linux )
+	addr.sin_addr.s_addr = address;
+#endif
+	addr.sin_port = htons(port);
+
+	while(1)
+	{
+		sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if(sock < 0) {
+			fprintf(stderr, "Client: %04llu exit of socket error.\n", index);
+			break;
+		}
+		if(connect(sock, (SOCKADDR*)&addr, sizeof(SOCKADDR)) == 0) {
+			memset(message, 0, sizeof(message));
+			sprintf(message, "Churn: %04llu %lu", index, __atomic_load_n(&churned[index], __ATOMIC_RELAXED));
+			send(sock, message, strlen(message) + 1, 0);
+			//主线程同时读取计数
+			__atomic_fetch_add(&churned[index], 1, __ATOMIC_RELAXED);
+		}
+#if defined ( _WIN32 )
+		closesocket(sock);
+		Sleep(1000 / churn);
+#else
+		close(sock);
+		usleep(1000000 / churn);
+#endif
+	}
+
+#if defined ( _WIN32 )
+	WSACleanup();
+#endif
+
+	return(0);
+}
+
 
 /**
-  * @brief
+  * @brief  参数列表 -> 主站地址 端口 客户端数量 [每个客户端每秒断开次数]
+  * ./client 127.0.0.1 4056 100
+  * ./client 127.0.0.1 4056 100 100
   */
 int main(int argc, char **argv) {
 #if defined ( WIN32 )
@@ -160,8 +220,8 @@ int main(int argc, char **argv) {
 #endif
 
 	//判断参数有效性
-	if(argc != 4) {
-		printf("Three args need : address port clients\n");
+	if((argc != 4) && (argc != 5)) {
+		printf("Three args need : address port clients [churn]\n");
 		return 0;
 	}
 
@@ -186,20 +246,46 @@ int main(int argc, char **argv) {
 		return 0;
 	}
 
+	//连接风暴，每个客户端每秒断开次数
+	if(argc == 5) {
+		churn = atoi(argv[4]);
+		if((churn < 1) || (churn > 1000)) {
+			printf("Churn invalid.\n");
+			return 0;
+		}
+	}
+
 	for(int i=0; i<clients; i++) {
 #if defined ( WIN32 )
-		hThread = CreateThread(NULL, 0, ThreadTest, (LPVOID)i, 0, NULL);
+		hThread = CreateThread(NULL, 0, churn ? ThreadChurn : ThreadTest, (LPVOID)(intptr_t)i, 0, NULL);
 		CloseHandle(hThread);
 		Sleep(10);
 #else
 		pthread_attr_init(&thread_attr);
 		pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
-		pthread_create(&thread, &thread_attr, ThreadTest, (void *)i);
+		pthread_create(&thread, &thread_attr, churn ? ThreadChurn : ThreadTest, (void *)(intptr_t)i);
 		pthread_attr_destroy(&thread_attr);
 		usleep(10*1000);
 #endif
 	}
 
+	//输出每秒断开次数
+	unsigned long last = 0;
+	while(churn) {
+		unsigned long total = 0;
+#if defined ( WIN32 )
+		Sleep(1000);
+#else
+		sleep(1);
+#endif
+		for(int i=0; i<clients; i++) {
+			total += __atomic_load_n(&churned[i], __ATOMIC_RELAXED);
+		}
+		printf("Churn: %lu disconnects/s\n", total - last);
+		fflush(stdout);
+		last = total;
+	}
+
 	getchar();
 
 	return 0;
@@ -0,0 +1,920 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "uv.h"
+#include "sqlite3.h"
+#include "db.hpp"
+
+#define DB_QUEUE_MAX				(1024*1024)
+#define DB_DETAIL_SIZE				64
+#define DB_BUSY_TIMEOUT				1000
+#define DB_SEEN_ROWS				128
+#define DB_DAY_SECONDS				86400
+
+enum __db_statement {
+	STMT_BEGIN = 0,
+	STMT_COMMIT,
+	STMT_ROLLBACK,
+	STMT_REGISTER,
+	STMT_SEEN,
+	STMT_SEEN_BULK,
+	STMT_OFFLINE,
+	STMT_EVENT,
+	STMT_LOGIN,
+	STMT_AMOUNT,
+};
+
+typedef struct __db_record {
+	struct __db_record *next;
+	uint8_t type;
+	unsigned char ip[4];
+	unsigned short port;
+	time_t time;
+	int64_t seen;
+	char name[32];
+	char detail[DB_DETAIL_SIZE];
+	unsigned int count;
+	db_seen *rows;
+	uint32_t profile;
+	unsigned int size;
+	char *frame;
+} db_record;
+
+typedef struct __db_reader {
+	struct __db_reader *next;
+	sqlite3 *db;
+	sqlite3_stmt *meta;
+} db_reader;
+
+typedef struct __db_writer {
+	sqlite3 *db;
+	char path[512];
+	sqlite3_stmt *stmts[STMT_AMOUNT];
+	uv_thread_t thread;
+	uv_mutex_t lock;
+	uv_cond_t cond;
+	unsigned int interval;
+	unsigned int retain;
+	int64_t day;
+	uint8_t prune;
+	uint8_t stop;
+	db_record *inbox;
+	db_stats stats;
+	uv_key_t key;
+	uv_mutex_t readers_lock;
+	db_reader *readers;
+} db_writer;
+
+static db_writer writer;
+
+static const char *schema = \
+"CREATE TABLE IF NOT EXISTS meters(" \
+"name TEXT PRIMARY KEY, ip TEXT, port INTEGER, online INTEGER, registered INTEGER, seen INTEGER) WITHOUT ROWID;" \
+"CREATE TABLE IF NOT EXISTS logins(" \
+"name TEXT PRIMARY KEY, frame BLOB, profile INTEGER) WITHOUT ROWID;";
+
+static const char *statements[STMT_AMOUNT] = {
+	"BEGIN",
+	"COMMIT",
+	"ROLLBACK",
+	"INSERT INTO meters(name, ip, port, online, registered, seen) VALUES(?1, ?2, ?3, 1, ?4, ?4) " \
+	"ON CONFLICT(name) DO UPDATE SET ip=excluded.ip, port=excluded.port, online=1, registered=excluded.registered, seen=excluded.seen",
+	"INSERT INTO meters(name, online, seen) VALUES(?1, 1, ?2) ON CONFLICT(name) DO UPDATE SET seen=max(seen, excluded.seen)",
+	(const char *)0,
+	"UPDATE meters SET online=0, seen=max(seen, ?2) WHERE name=?1",
+	(const char *)0,
+	"INSERT INTO logins(name, frame, profile) VALUES(?1, ?2, ?3) " \
+	"ON CONFLICT(name) DO UPDATE SET frame=excluded.frame, profile=excluded.profile",
+};
+
+
+
+/**
+  * @brief  执行一条缓存的语句
+  */
+static int db_step(sqlite3_stmt *stmt) {
+	int rc = sqlite3_step(stmt);
+
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+
+	return ((rc == SQLITE_DONE) || (rc == SQLITE_ROW)) ? 0 : -1;
+}
+
+/**
+  * @brief  天数 (UNIX 纪元起，UTC) 转为分表名 events_YYYYMMDD
+  *         按公历直接计算，不使用 gmtime，工作线程中的脚本可能同时使用其静态缓冲区
+  */
+static void db_day_name(int64_t day, char *name, size_t length) {
+	int64_t z = day + 719468;
+	int64_t era = ((z >= 0) ? z : (z - 146096)) / 146097;
+	unsigned int doe = (unsigned int)(z - era * 146097);
+	unsigned int yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	unsigned int doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	unsigned int mp = (5 * doy + 2) / 153;
+	unsigned int d = doy - (153 * mp + 2) / 5 + 1;
+	unsigned int m = (mp < 10) ? (mp + 3) : (mp - 9);
+	int64_t y = (int64_t)yoe + era * 400 + ((m <= 2) ? 1 : 0);
+
+	snprintf(name, length, "events_%04d%02u%02u", (int)y, m, d);
+}
+
+/**
+  * @brief  创建某一天的分表，table 返回分表名
+  */
+static int db_partition_create(int64_t day, char *table, size_t length) {
+	char *error = (char *)0;
+	char sql[256];
+
+	db_day_name(day, table, length);
+	snprintf(sql, sizeof(sql), "CREATE TABLE IF NOT EXISTS %s(" \
+	"id INTEGER PRIMARY KEY, time INTEGER, type INTEGER, name TEXT, ip TEXT, port INTEGER, detail TEXT)", table);
+	if(sqlite3_exec(writer.db, sql, 0, 0, &error) != SQLITE_OK) {
+		fprintf(stderr, "Create %s failed: %s\n", table, error ? error : sqlite3_errmsg(writer.db));
+		sqlite3_free(error);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+  * @brief  准备写入某一天分表的语句，分表不存在时创建
+  */
+static sqlite3_stmt *db_partition_prepare(int64_t day) {
+	sqlite3_stmt *stmt = (sqlite3_stmt *)0;
+	char table[32];
+	char sql[256];
+
+	if(db_partition_create(day, table, sizeof(table))) {
+		return (sqlite3_stmt *)0;
+	}
+	snprintf(sql, sizeof(sql), "INSERT INTO %s(time, type, name, ip, port, detail) VALUES(?1, ?2, ?3, ?4, ?5, ?6)", table);
+	if(sqlite3_prepare_v2(writer.db, sql, -1, &stmt, 0) != SQLITE_OK) {
+		fprintf(stderr, "Prepare statement failed: %s\n", sqlite3_errmsg(writer.db));
+		return (sqlite3_stmt *)0;
+	}
+
+	return stmt;
+}
+
+/**
+  * @brief  删除一张超出保留天数的分表，只删除表不逐行删除
+  *         删除整表需要释放其全部页，在批量事务之外单独提交，不阻塞排队的事件
+  * @retval 1 删除了一张分表，0 没有过期的分表，-1 出错
+  */
+static int db_prune(void) {
+	sqlite3_stmt *stmt = (sqlite3_stmt *)0;
+	char cutoff[32];
+	char table[64];
+	char sql[96];
+	int rc;
+
+	if(!writer.retain) {
+		return 0;
+	}
+	//保留包括当天在内的 retain 天
+	db_day_name(writer.day - writer.retain + 1, cutoff, sizeof(cutoff));
+	if(sqlite3_prepare_v2(writer.db, "SELECT name FROM sqlite_master WHERE type='table' " \
+	"AND name GLOB 'events_[0-9][0-9][0-9][0-9][0-9][0-9][0-9][0-9]' AND name < ?1 ORDER BY name LIMIT 1", -1, &stmt, 0) != SQLITE_OK) {
+		fprintf(stderr, "Prepare statement failed: %s\n", sqlite3_errmsg(writer.db));
+		return -1;
+	}
+	sqlite3_bind_text(stmt, 1, cutoff, -1, SQLITE_STATIC);
+	rc = sqlite3_step(stmt);
+	if(rc == SQLITE_ROW) {
+		snprintf(table, sizeof(table), "%s", (const char *)sqlite3_column_text(stmt, 0));
+	}
+	sqlite3_finalize(stmt);
+	if(rc != SQLITE_ROW) {
+		return (rc == SQLITE_DONE) ? 0 : -1;
+	}
+
+	snprintf(sql, sizeof(sql), "DROP TABLE %s", table);
+	if(db_step(writer.stmts[STMT_BEGIN])) {
+		fprintf(stderr, "Database begin failed: %s\n", sqlite3_errmsg(writer.db));
+		return -1;
+	}
+	if(sqlite3_exec(writer.db, sql, 0, 0, 0) != SQLITE_OK) {
+		fprintf(stderr, "Drop %s failed: %s\n", table, sqlite3_errmsg(writer.db));
+		db_step(writer.stmts[STMT_ROLLBACK]);
+		return -1;
+	}
+	if(db_step(writer.stmts[STMT_COMMIT])) {
+		fprintf(stderr, "Database commit failed: %s\n", sqlite3_errmsg(writer.db));
+		db_step(writer.stmts[STMT_ROLLBACK]);
+		return -1;
+	}
+	__atomic_add_fetch(&writer.stats.pruned, 1, __ATOMIC_RELAXED);
+
+	return 1;
+}
+
+/**
+  * @brief  切换到新一天的分表，在批量事务之外调用，过期的分表在下次批量提交后删除
+  */
+static int db_partition(int64_t day) {
+	sqlite3_stmt *stmt = db_partition_prepare(day);
+
+	if(!stmt) {
+		return -1;
+	}
+	sqlite3_finalize(writer.stmts[STMT_EVENT]);
+	writer.stmts[STMT_EVENT] = stmt;
+	writer.day = day;
+	writer.prune = 1;
+
+	return 0;
+}
+
+/**
+  * @brief  生成多行 upsert 语句，每块 DB_SEEN_ROWS 行
+  */
+static char *db_seen_statement(void) {
+	const char *head = "INSERT INTO meters(name, online, seen) VALUES";
+	const char *tail = " ON CONFLICT(name) DO UPDATE SET seen=max(seen, excluded.seen)";
+	size_t length = strlen(head) + strlen(tail) + DB_SEEN_ROWS * 16 + 1;
+	char *sql = (char *)malloc(length);
+	size_t used;
+
+	if(!sql) {
+		return (char *)0;
+	}
+	used = sprintf(sql, "%s", head);
+	for(unsigned int n=0; n<DB_SEEN_ROWS; n++) {
+		used += sprintf(sql + used, "%s(?, 1, ?)", n ? "," : "");
+	}
+	strcpy(sql + used, tail);
+
+	return sql;
+}
+
+/**
+  * @brief  更新表计最后在线时间，整块使用多行语句，剩余的逐行写入
+  */
+static int db_seen_rows(const db_seen *rows, unsigned int count) {
+	sqlite3_stmt *stmt;
+	unsigned int done = 0;
+
+	while((count - done) >= DB_SEEN_ROWS) {
+		stmt = writer.stmts[STMT_SEEN_BULK];
+		for(unsigned int n=0; n<DB_SEEN_ROWS; n++) {
+			sqlite3_bind_text(stmt, n * 2 + 1, rows[done + n].name, -1, SQLITE_STATIC);
+			sqlite3_bind_int64(stmt, n * 2 + 2, (sqlite3_int64)rows[done + n].seen);
+		}
+		if(db_step(stmt)) {
+			return -1;
+		}
+		done += DB_SEEN_ROWS;
+	}
+	stmt = writer.stmts[STMT_SEEN];
+	while(done < count) {
+		sqlite3_bind_text(stmt, 1, rows[done].name, -1, SQLITE_STATIC);
+		sqlite3_bind_int64(stmt, 2, (sqlite3_int64)rows[done].seen);
+		if(db_step(stmt)) {
+			return -1;
+		}
+		done += 1;
+	}
+	__atomic_add_fetch(&writer.stats.seen, count, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+/**
+  * @brief  写入一个事件
+  */
+static int db_apply(const db_record *record) {
+	sqlite3_stmt *stmt;
+	char ip[16];
+
+	snprintf(ip, sizeof(ip), "%u.%u.%u.%u", record->ip[0], record->ip[1], record->ip[2], record->ip[3]);
+
+	switch(record->type) {
+		case DB_REGISTER:
+			stmt = writer.stmts[STMT_REGISTER];
+			sqlite3_bind_text(stmt, 1, record->name, -1, SQLITE_STATIC);
+			sqlite3_bind_text(stmt, 2, ip, -1, SQLITE_STATIC);
+			sqlite3_bind_int(stmt, 3, record->port);
+			sqlite3_bind_int64(stmt, 4, (sqlite3_int64)record->time);
+			if(db_step(stmt)) {
+				return -1;
+			}
+			if(record->frame) {
+				stmt = writer.stmts[STMT_LOGIN];
+				sqlite3_bind_text(stmt, 1, record->name, -1, SQLITE_STATIC);
+				sqlite3_bind_blob(stmt, 2, record->frame, record->size, SQLITE_STATIC);
+				sqlite3_bind_int64(stmt, 3, (sqlite3_int64)record->profile);
+				if(db_step(stmt)) {
+					return -1;
+				}
+			}
+			break;
+		case DB_HEARTBEAT:
+			//心跳不记录事件
+			if(record->rows) {
+				return db_seen_rows(record->rows, record->count);
+			}
+			else {
+				db_seen row;
+				memcpy(row.name, record->name, sizeof(row.name));
+				row.seen = (int64_t)record->time;
+				return db_seen_rows(&row, 1);
+			}
+		case DB_DISCONNECT:
+			stmt = writer.stmts[STMT_OFFLINE];
+			sqlite3_bind_text(stmt, 1, record->name, -1, SQLITE_STATIC);
+			sqlite3_bind_int64(stmt, 2, (sqlite3_int64)record->seen);
+			if(db_step(stmt)) {
+				return -1;
+			}
+			break;
+		case DB_ERROR:
+			break;
+		default:
+			return -1;
+	}
+
+	//事件写入发生当天的分表，当前分表在批量事务之外切换
+	int64_t day = (int64_t)record->time / DB_DAY_SECONDS;
+	if(day == writer.day) {
+		stmt = writer.stmts[STMT_EVENT];
+	}
+	else {
+		//跨天前产生、跨天后提交的事件，已超出保留天数的丢弃；切换失败时逐条写入新一天的分表
+		if(writer.retain && ((writer.day - day) >= writer.retain)) {
+			return -1;
+		}
+		stmt = db_partition_prepare(day);
+		if(!stmt) {
+			return -1;
+		}
+	}
+
+	sqlite3_bind_int64(stmt, 1, (sqlite3_int64)record->time);
+	sqlite3_bind_int(stmt, 2, record->type);
+	if(record->name[0]) {
+		sqlite3_bind_text(stmt, 3, record->name, -1, SQLITE_STATIC);
+	}
+	sqlite3_bind_text(stmt, 4, ip, -1, SQLITE_STATIC);
+	sqlite3_bind_int(stmt, 5, record->port);
+	if(record->detail[0]) {
+		sqlite3_bind_text(stmt, 6, record->detail, -1, SQLITE_STATIC);
+	}
+
+	if(stmt != writer.stmts[STMT_EVENT]) {
+		int rc = db_step(stmt);
+		sqlite3_finalize(stmt);
+		return rc;
+	}
+
+	return db_step(stmt);
+}
+
+/**
+  * @brief  取出写队列中的全部事件，在一个事务中写入
+  */
+static void db_commit(void) {
+	db_record *list = __atomic_exchange_n(&writer.inbox, (db_record *)0, __ATOMIC_ACQUIRE);
+	db_record *ordered = (db_record *)0;
+	unsigned long count = 0, written = 0, failed = 0;
+	int64_t day = writer.day;
+	uint64_t start;
+
+	//写队列为后进先出，反转后按发生顺序写入
+	while(list) {
+		db_record *record = list;
+		list = list->next;
+		record->next = ordered;
+		ordered = record;
+		count += 1;
+		if(((int64_t)record->time / DB_DAY_SECONDS) > day) {
+			day = (int64_t)record->time / DB_DAY_SECONDS;
+		}
+	}
+	if(!count) {
+		return;
+	}
+
+	start = uv_hrtime();
+	//跨天时在批量事务之前创建并切换分表，批量事务回滚后分表与语句仍然有效
+	if((day > writer.day) && db_partition(day)) {
+		fprintf(stderr, "Switch to partition of day %lld failed: %s\n", (long long)day, sqlite3_errmsg(writer.db));
+	}
+	if(db_step(writer.stmts[STMT_BEGIN])) {
+		fprintf(stderr, "Database begin failed: %s\n", sqlite3_errmsg(writer.db));
+		while(ordered) {
+			db_record *record = ordered;
+			ordered = ordered->next;
+			free(record);
+		}
+	}
+	else {
+		while(ordered) {
+			db_record *record = ordered;
+			ordered = ordered->next;
+			if(db_apply(record)) {
+				//单条失败不影响同一事务中的其它事件，每个事务只输出一次错误
+				if(!failed) {
+					fprintf(stderr, "Database write failed: %s\n", sqlite3_errmsg(writer.db));
+				}
+				failed += 1;
+			}
+			else {
+				written += 1;
+			}
+			free(record);
+		}
+		if(db_step(writer.stmts[STMT_COMMIT])) {
+			fprintf(stderr, "Database commit failed: %s\n", sqlite3_errmsg(writer.db));
+			db_step(writer.stmts[STMT_ROLLBACK]);
+			written = 0;
+		}
+		else {
+			__atomic_add_fetch(&writer.stats.commits, 1, __ATOMIC_RELAXED);
+		}
+	}
+
+	__atomic_store_n(&writer.stats.commit_us, (uv_hrtime() - start) / 1000, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&writer.stats.pending, count, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&writer.stats.written, written, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&writer.stats.dropped, count - written, __ATOMIC_RELAXED);
+}
+
+/**
+  * @brief  写线程，每个周期提交一次，停止时写入剩余的事件
+  */
+static void db_run(void *arg) {
+	uv_mutex_lock(&writer.lock);
+	while(!writer.stop) {
+		uv_cond_timedwait(&writer.cond, &writer.lock, (uint64_t)writer.interval * 1000000);
+		uv_mutex_unlock(&writer.lock);
+		db_commit();
+		//跨天后在两次批量提交之间删除过期的分表，每个周期一张
+		if(writer.prune && (db_prune() <= 0)) {
+			writer.prune = 0;
+		}
+		uv_mutex_lock(&writer.lock);
+	}
+	uv_mutex_unlock(&writer.lock);
+
+	db_commit();
+}
+
+/**
+  * @brief  释放缓存的语句并关闭数据库
+  */
+static void db_release(void) {
+	for(unsigned int n=0; n<STMT_AMOUNT; n++) {
+		sqlite3_finalize(writer.stmts[n]);
+		writer.stmts[n] = (sqlite3_stmt *)0;
+	}
+	sqlite3_close(writer.db);
+	writer.db = (sqlite3 *)0;
+}
+
+/**
+  * @brief  获取本线程的只读连接，首次调用时打开
+  */
+static db_reader *db_reader_get(void) {
+	db_reader *reader = (db_reader *)uv_key_get(&writer.key);
+
+	if(reader) {
+		return reader;
+	}
+
+	reader = (db_reader *)calloc(1, sizeof(db_reader));
+	if(!reader) {
+		fprintf(stderr, "No memory for database reader\n");
+		return (db_reader *)0;
+	}
+	if(sqlite3_open_v2(writer.path, &reader->db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, 0) != SQLITE_OK) {
+		fprintf(stderr, "Open database %s failed: %s\n", writer.path, sqlite3_errmsg(reader->db));
+		sqlite3_close(reader->db);
+		free(reader);
+		return (db_reader *)0;
+	}
+	sqlite3_busy_timeout(reader->db, DB_BUSY_TIMEOUT);
+	if(sqlite3_prepare_v2(reader->db, "SELECT seen, ip, port FROM meters WHERE name=?1", -1, &reader->meta, 0) != SQLITE_OK) {
+		fprintf(stderr, "Prepare statement failed: %s\n", sqlite3_errmsg(reader->db));
+		sqlite3_close(reader->db);
+		free(reader);
+		return (db_reader *)0;
+	}
+
+	uv_mutex_lock(&writer.readers_lock);
+	reader->next = writer.readers;
+	writer.readers = reader;
+	__atomic_add_fetch(&writer.stats.readers, 1, __ATOMIC_RELAXED);
+	uv_mutex_unlock(&writer.readers_lock);
+	uv_key_set(&writer.key, reader);
+
+	return reader;
+}
+
+/**
+  * @brief  关闭全部只读连接
+  */
+static void db_reader_close(void) {
+	uv_mutex_lock(&writer.readers_lock);
+	while(writer.readers) {
+		db_reader *reader = writer.readers;
+		writer.readers = reader->next;
+		sqlite3_finalize(reader->meta);
+		sqlite3_close(reader->db);
+		free(reader);
+	}
+	uv_mutex_unlock(&writer.readers_lock);
+}
+
+/**
+  * @brief  打开数据库并启动写线程
+  */
+int db_open(const char *path, unsigned int interval, unsigned int retain) {
+	char *error = (char *)0;
+	int rc;
+
+	memset(&writer, 0, sizeof(writer));
+	if(!path || !path[0]) {
+		return 0;
+	}
+	if(strlen(path) >= sizeof(writer.path)) {
+		fprintf(stderr, "Invalid database path\n");
+		return -1;
+	}
+	strcpy(writer.path, path);
+	writer.interval = interval ? interval : 1;
+	writer.retain = retain;
+
+	if(sqlite3_open(path, &writer.db) != SQLITE_OK) {
+		fprintf(stderr, "Open database %s failed: %s\n", path, sqlite3_errmsg(writer.db));
+		sqlite3_close(writer.db);
+		writer.db = (sqlite3 *)0;
+		return -1;
+	}
+	sqlite3_busy_timeout(writer.db, DB_BUSY_TIMEOUT);
+
+	//WAL 模式下写入不阻塞读取，NORMAL 只在检查点同步磁盘
+	if((sqlite3_exec(writer.db, "PRAGMA journal_mode=WAL; PRAGMA synchronous=NORMAL;", 0, 0, &error) != SQLITE_OK) || \
+	(sqlite3_exec(writer.db, schema, 0, 0, &error) != SQLITE_OK)) {
+		fprintf(stderr, "Initialize database failed: %s\n", error ? error : sqlite3_errmsg(writer.db));
+		sqlite3_free(error);
+		db_release();
+		return -1;
+	}
+
+	for(unsigned int n=0; n<STMT_AMOUNT; n++) {
+		//事件语句随分表切换
+		if(n == STMT_EVENT) {
+			continue;
+		}
+		char *sql = (n == STMT_SEEN_BULK) ? db_seen_statement() : (char *)statements[n];
+		if(!sql) {
+			fprintf(stderr, "No memory for statement\n");
+			db_release();
+			return -1;
+		}
+		rc = sqlite3_prepare_v2(writer.db, sql, -1, &writer.stmts[n], 0);
+		if(n == STMT_SEEN_BULK) {
+			free(sql);
+		}
+		if(rc != SQLITE_OK) {
+			fprintf(stderr, "Prepare statement failed: %s\n", sqlite3_errmsg(writer.db));
+			db_release();
+			return -1;
+		}
+	}
+
+	//写入当天的分表，启动时删除全部过期的分表
+	if(db_partition((int64_t)time(NULL) / DB_DAY_SECONDS)) {
+		db_release();
+		return -1;
+	}
+	while(db_prune() > 0);
+	writer.prune = 0;
+
+	if((rc = uv_mutex_init(&writer.lock))) {
+		fprintf(stderr, "uv_mutex_init failed %s\n", uv_strerror(rc));
+		db_release();
+		return -1;
+	}
+	if((rc = uv_cond_init(&writer.cond))) {
+		fprintf(stderr, "uv_cond_init failed %s\n", uv_strerror(rc));
+		uv_mutex_destroy(&writer.lock);
+		db_release();
+		return -1;
+	}
+	//工作线程的只读连接
+	if((rc = uv_key_create(&writer.key)) || (rc = uv_mutex_init(&writer.readers_lock))) {
+		fprintf(stderr, "Initialize database readers failed %s\n", uv_strerror(rc));
+		uv_cond_destroy(&writer.cond);
+		uv_mutex_destroy(&writer.lock);
+		db_release();
+		return -1;
+	}
+	if((rc = uv_thread_create(&writer.thread, db_run, (void *)0))) {
+		fprintf(stderr, "uv_thread_create failed %s\n", uv_strerror(rc));
+		uv_mutex_destroy(&writer.readers_lock);
+		uv_key_delete(&writer.key);
+		uv_cond_destroy(&writer.cond);
+		uv_mutex_destroy(&writer.lock);
+		db_release();
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+  * @brief  放入写队列 (无锁多生产者单消费者栈)，由写线程按周期批量取出
+  */
+static void db_push(db_record *record) {
+	db_record *head;
+
+	__atomic_add_fetch(&writer.stats.pending, 1, __ATOMIC_RELAXED);
+	head = __atomic_load_n(&writer.inbox, __ATOMIC_RELAXED);
+	do {
+		record->next = head;
+	} while(!__atomic_compare_exchange_n(&writer.inbox, &head, record, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/**
+  * @brief  事件放入写队列
+  */
+int db_event(enum __db_event type, const char *name, const unsigned char *ip, unsigned short port, const char *detail) {
+	db_record *record;
+
+	if(!writer.db) {
+		return 0;
+	}
+	//数据库写入跟不上时丢弃，不占用更多内存
+	if(__atomic_load_n(&writer.stats.pending, __ATOMIC_RELAXED) >= DB_QUEUE_MAX) {
+		__atomic_add_fetch(&writer.stats.dropped, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	record = (db_record *)malloc(sizeof(db_record));
+	if(!record) {
+		__atomic_add_fetch(&writer.stats.dropped, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+	memset(record, 0, sizeof(db_record));
+	record->type = (uint8_t)type;
+	record->port = port;
+	record->time = time(NULL);
+	record->seen = (int64_t)record->time;
+	if(ip) {
+		memcpy(record->ip, ip, sizeof(record->ip));
+	}
+	if(name) {
+		strncpy(record->name, name, sizeof(record->name) - 1);
+	}
+	if(detail) {
+		strncpy(record->detail, detail, sizeof(record->detail) - 1);
+	}
+
+	db_push(record);
+
+	return 0;
+}
+
+/**
+  * @brief  注册事件与登录帧放入写队列
+  */
+int db_register(const char *name, const unsigned char *ip, unsigned short port, const char *frame, unsigned int size, uint32_t profile) {
+	db_record *record;
+
+	if(!writer.db) {
+		return 0;
+	}
+	if(!frame || !size || (size > DB_LOGIN_SIZE)) {
+		return db_event(DB_REGISTER, name, ip, port, (const char *)0);
+	}
+	if(__atomic_load_n(&writer.stats.pending, __ATOMIC_RELAXED) >= DB_QUEUE_MAX) {
+		__atomic_add_fetch(&writer.stats.dropped, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	//记录与登录帧一次分配
+	record = (db_record *)malloc(sizeof(db_record) + size);
+	if(!record) {
+		__atomic_add_fetch(&writer.stats.dropped, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+	memset(record, 0, sizeof(db_record));
+	record->type = DB_REGISTER;
+	record->port = port;
+	record->time = time(NULL);
+	if(ip) {
+		memcpy(record->ip, ip, sizeof(record->ip));
+	}
+	strncpy(record->name, name, sizeof(record->name) - 1);
+	record->profile = profile;
+	record->size = size;
+	record->frame = (char *)(record + 1);
+	memcpy(record->frame, frame, size);
+
+	db_push(record);
+
+	return 0;
+}
+
+/**
+  * @brief  断开事件，表计最后在线时间取 seen 而不是断开时间
+  */
+int db_disconnect(const char *name, const unsigned char *ip, unsigned short port, int64_t seen) {
+	db_record *record;
+
+	if(!writer.db) {
+		return 0;
+	}
+	if(__atomic_load_n(&writer.stats.pending, __ATOMIC_RELAXED) >= DB_QUEUE_MAX) {
+		__atomic_add_fetch(&writer.stats.dropped, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	record = (db_record *)malloc(sizeof(db_record));
+	if(!record) {
+		__atomic_add_fetch(&writer.stats.dropped, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+	memset(record, 0, sizeof(db_record));
+	record->type = DB_DISCONNECT;
+	record->port = port;
+	record->time = time(NULL);
+	record->seen = seen;
+	if(ip) {
+		memcpy(record->ip, ip, sizeof(record->ip));
+	}
+	strncpy(record->name, name, sizeof(record->name) - 1);
+
+	db_push(record);
+
+	return 0;
+}
+
+/**
+  * @brief  读取登录帧
+  */
+db_login *db_logins(uint32_t profile, unsigned long *count) {
+	sqlite3 *db = (sqlite3 *)0;
+	sqlite3_stmt *stmt = (sqlite3_stmt *)0;
+	db_login *logins = (db_login *)0;
+	unsigned long capacity = 0;
+	int rc;
+
+	*count = 0;
+	if(!writer.db) {
+		return (db_login *)0;
+	}
+	if(sqlite3_open_v2(writer.path, &db, SQLITE_OPEN_READONLY, 0) != SQLITE_OK) {
+		fprintf(stderr, "Open database %s failed: %s\n", writer.path, sqlite3_errmsg(db));
+		sqlite3_close(db);
+		return (db_login *)0;
+	}
+	if(sqlite3_prepare_v2(db, "SELECT name, frame FROM logins WHERE profile=?1", -1, &stmt, 0) != SQLITE_OK) {
+		fprintf(stderr, "Prepare statement failed: %s\n", sqlite3_errmsg(db));
+		sqlite3_close(db);
+		return (db_login *)0;
+	}
+	sqlite3_bind_int64(stmt, 1, (sqlite3_int64)profile);
+
+	while((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		const char *name = (const char *)sqlite3_column_text(stmt, 0);
+		const void *frame = sqlite3_column_blob(stmt, 1);
+		int size = sqlite3_column_bytes(stmt, 1);
+
+		if(!name || !frame || (strlen(name) >= sizeof(logins->name)) || (size <= 0) || (size > DB_LOGIN_SIZE)) {
+			continue;
+		}
+		if(*count >= capacity) {
+			unsigned long grown = capacity ? (capacity * 2) : 1024;
+			db_login *larger = (db_login *)realloc(logins, grown * sizeof(db_login));
+			if(!larger) {
+				fprintf(stderr, "No memory for logins\n");
+				break;
+			}
+			logins = larger;
+			capacity = grown;
+		}
+		memset(&logins[*count], 0, sizeof(db_login));
+		strcpy(logins[*count].name, name);
+		logins[*count].size = (unsigned int)size;
+		memcpy(logins[*count].frame, frame, size);
+		*count += 1;
+	}
+	if((rc != SQLITE_ROW) && (rc != SQLITE_DONE)) {
+		fprintf(stderr, "Read logins failed: %s\n", sqlite3_errmsg(db));
+	}
+
+	sqlite3_finalize(stmt);
+	sqlite3_close(db);
+
+	return logins;
+}
+
+/**
+  * @brief  表计最后在线时间作为一个事件放入写队列
+  */
+int db_heartbeat(const db_seen *rows, unsigned int count) {
+	db_record *record;
+
+	if(!writer.db || !count) {
+		return 0;
+	}
+	if(__atomic_load_n(&writer.stats.pending, __ATOMIC_RELAXED) >= DB_QUEUE_MAX) {
+		__atomic_add_fetch(&writer.stats.dropped, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	//记录与数据行一次分配
+	record = (db_record *)malloc(sizeof(db_record) + (size_t)count * sizeof(db_seen));
+	if(!record) {
+		__atomic_add_fetch(&writer.stats.dropped, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+	memset(record, 0, sizeof(db_record));
+	record->type = DB_HEARTBEAT;
+	record->time = time(NULL);
+	record->count = count;
+	record->rows = (db_seen *)(record + 1);
+	memcpy(record->rows, rows, (size_t)count * sizeof(db_seen));
+
+	db_push(record);
+
+	return 0;
+}
+
+/**
+  * @brief  查询表计状态
+  */
+int db_meta_read(const char *name, db_meta *meta) {
+	db_reader *reader;
+	int rc;
+
+	if(!writer.db) {
+		return 0;
+	}
+	reader = db_reader_get();
+	if(!reader) {
+		return -1;
+	}
+
+	memset(meta, 0, sizeof(db_meta));
+	sqlite3_bind_text(reader->meta, 1, name, -1, SQLITE_STATIC);
+	rc = sqlite3_step(reader->meta);
+	if(rc == SQLITE_ROW) {
+		const char *ip = (const char *)sqlite3_column_text(reader->meta, 1);
+		meta->seen = (int64_t)sqlite3_column_int64(reader->meta, 0);
+		meta->port = (unsigned short)sqlite3_column_int(reader->meta, 2);
+		if(ip) {
+			uv_inet_pton(AF_INET, ip, meta->ip);
+		}
+	}
+	else if(rc != SQLITE_DONE) {
+		fprintf(stderr, "Read meter failed: %s\n", sqlite3_errmsg(reader->db));
+	}
+	sqlite3_reset(reader->meta);
+	sqlite3_clear_bindings(reader->meta);
+	__atomic_add_fetch(&writer.stats.reads, 1, __ATOMIC_RELAXED);
+
+	return (rc == SQLITE_ROW) ? 1 : ((rc == SQLITE_DONE) ? 0 : -1);
+}
+
+/**
+  * @brief  读取写线程统计
+  */
+void db_statistics(db_stats *stats) {
+	stats->pending = __atomic_load_n(&writer.stats.pending, __ATOMIC_RELAXED);
+	stats->written = __atomic_load_n(&writer.stats.written, __ATOMIC_RELAXED);
+	stats->dropped = __atomic_load_n(&writer.stats.dropped, __ATOMIC_RELAXED);
+	stats->commits = __atomic_load_n(&writer.stats.commits, __ATOMIC_RELAXED);
+	stats->seen = __atomic_load_n(&writer.stats.seen, __ATOMIC_RELAXED);
+	stats->reads = __atomic_load_n(&writer.stats.reads, __ATOMIC_RELAXED);
+	stats->readers = __atomic_load_n(&writer.stats.readers, __ATOMIC_RELAXED);
+	stats->pruned = __atomic_load_n(&writer.stats.pruned, __ATOMIC_RELAXED);
+	stats->commit_us = __atomic_load_n(&writer.stats.commit_us, __ATOMIC_RELAXED);
+}
+
+/**
+  * @brief  停止写线程并关闭数据库
+  */
+void db_close(void) {
+	if(!writer.db) {
+		return;
+	}
+
+	uv_mutex_lock(&writer.lock);
+	writer.stop = 1;
+	uv_cond_signal(&writer.cond);
+	uv_mutex_unlock(&writer.lock);
+	uv_thread_join(&writer.thread);
+
+	uv_cond_destroy(&writer.cond);
+	uv_mutex_destroy(&writer.lock);
+	db_reader_close();
+	uv_mutex_destroy(&writer.readers_lock);
+	uv_key_delete(&writer.key);
+	db_release();
+}
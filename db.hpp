@@ -0,0 +1,114 @@
+#ifndef __DB_HPP__
+#define __DB_HPP__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DB_LOGIN_SIZE				128
+
+/**
+  * @brief  写入数据库的事件
+  */
+enum __db_event {
+	DB_REGISTER = 0,//注册，更新表计状态并记录事件
+	DB_HEARTBEAT,//心跳，只更新表计最后在线时间，通常由 db_heartbeat 批量写入
+	DB_ERROR,//错误，记录事件
+	DB_DISCONNECT,//断开，更新表计状态并记录事件
+};
+
+/**
+  * @brief  写线程统计
+  */
+typedef struct __db_stats {
+	unsigned long pending;//队列中等待写入的事件
+	unsigned long written;//已写入的事件
+	unsigned long dropped;//队列已满或写入失败丢弃的事件
+	unsigned long commits;//提交的事务
+	unsigned long seen;//已更新的表计最后在线时间
+	uint64_t commit_us;//最近一次事务耗时 (微秒)
+	unsigned long reads;//只读连接的查询次数
+	unsigned long readers;//只读连接数量
+	unsigned long pruned;//已删除的过期事件分表
+} db_stats;
+
+/**
+  * @brief  打开数据库并启动写线程，interval 为批量提交的间隔 (毫秒)
+  *         事件按发生日期 (UTC) 写入分表 events_YYYYMMDD，只保留最近 retain 天，0 全部保留
+  *         path 为空时不写数据库，之后的调用均直接返回
+  */
+int db_open(const char *path, unsigned int interval, unsigned int retain);
+
+/**
+  * @brief  事件放入写队列，任意线程调用，不等待数据库
+  *         ip 为 4 字节网络序地址，可为空；detail 为附加说明，可为空
+  * @retval 0 成功，-1 队列已满或内存不足
+  */
+int db_event(enum __db_event type, const char *name, const unsigned char *ip, unsigned short port, const char *detail);
+
+/**
+  * @brief  表计最后在线时间
+  */
+typedef struct __db_seen {
+	char name[32];
+	int64_t seen;
+} db_seen;
+
+/**
+  * @brief  批量更新表计最后在线时间，rows 被拷贝，写线程中按块合并为多行 upsert
+  * @retval 0 成功，-1 队列已满或内存不足
+  */
+int db_heartbeat(const db_seen *rows, unsigned int count);
+
+/**
+  * @brief  表计的登录帧，profile 为分帧方式与注册脚本的散列值，二者不变时同一登录帧对应同一表计
+  */
+typedef struct __db_login {
+	char name[32];
+	unsigned int size;
+	char frame[DB_LOGIN_SIZE];
+} db_login;
+
+/**
+  * @brief  注册事件，同时保存表计的登录帧 (frame 为空或超过 DB_LOGIN_SIZE 时不保存)
+  * @retval 0 成功，-1 队列已满或内存不足
+  */
+int db_register(const char *name, const unsigned char *ip, unsigned short port, const char *frame, unsigned int size, uint32_t profile);
+
+/**
+  * @brief  断开事件，事件时间为当前时间，表计最后在线时间更新为 seen (通常为最后一次收到数据的时间)
+  * @retval 0 成功，-1 队列已满或内存不足
+  */
+int db_disconnect(const char *name, const unsigned char *ip, unsigned short port, int64_t seen);
+
+/**
+  * @brief  读取 profile 相同的全部登录帧，使用独立的只读连接，返回的数组由调用者释放
+  * @retval 登录帧数组，没有记录或出错时为空
+  */
+db_login *db_logins(uint32_t profile, unsigned long *count);
+
+/**
+  * @brief  表计在数据库中的状态
+  */
+typedef struct __db_meta {
+	int64_t seen;
+	unsigned char ip[4];
+	unsigned short port;
+} db_meta;
+
+/**
+  * @brief  查询表计状态，在工作线程中调用，每个线程使用各自的只读连接
+  * @retval 1 找到，0 没有记录，-1 出错
+  */
+int db_meta_read(const char *name, db_meta *meta);
+
+/**
+  * @brief  读取写线程统计
+  */
+void db_statistics(db_stats *stats);
+
+/**
+  * @brief  写入队列中剩余的事件，停止写线程并关闭数据库
+  */
+void db_close(void);
+
+#endif
@@ -0,0 +1,240 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "dlms.hpp"
+
+#define HDLC_FLAG					0x7E
+#define HDLC_MIN_SIZE				9
+#define WRAPPER_VERSION				0x0001
+#define WRAPPER_HEADER_SIZE			8
+
+static const uint16_t fcs_table[256] = {
+	0x0000, 0x1189, 0x2312, 0x329b, 0x4624, 0x57ad, 0x6536, 0x74bf,
+	0x8c48, 0x9dc1, 0xaf5a, 0xbed3, 0xca6c, 0xdbe5, 0xe97e, 0xf8f7,
+	0x1081, 0x0108, 0x3393, 0x221a, 0x56a5, 0x472c, 0x75b7, 0x643e,
+	0x9cc9, 0x8d40, 0xbfdb, 0xae52, 0xdaed, 0xcb64, 0xf9ff, 0xe876,
+	0x2102, 0x308b, 0x0210, 0x1399, 0x6726, 0x76af, 0x4434, 0x55bd,
+	0xad4a, 0xbcc3, 0x8e58, 0x9fd1, 0xeb6e, 0xfae7, 0xc87c, 0xd9f5,
+	0x3183, 0x200a, 0x1291, 0x0318, 0x77a7, 0x662e, 0x54b5, 0x453c,
+	0xbdcb, 0xac42, 0x9ed9, 0x8f50, 0xfbef, 0xea66, 0xd8fd, 0xc974,
+	0x4204, 0x538d, 0x6116, 0x709f, 0x0420, 0x15a9, 0x2732, 0x36bb,
+	0xce4c, 0xdfc5, 0xed5e, 0xfcd7, 0x8868, 0x99e1, 0xab7a, 0xbaf3,
+	0x5285, 0x430c, 0x7197, 0x601e, 0x14a1, 0x0528, 0x37b3, 0x263a,
+	0xdecd, 0xcf44, 0xfddf, 0xec56, 0x98e9, 0x8960, 0xbbfb, 0xaa72,
+	0x6306, 0x728f, 0x4014, 0x519d, 0x2522, 0x34ab, 0x0630, 0x17b9,
+	0xef4e, 0xfec7, 0xcc5c, 0xddd5, 0xa96a, 0xb8e3, 0x8a78, 0x9bf1,
+	0x7387, 0x620e, 0x5095, 0x411c, 0x35a3, 0x242a, 0x16b1, 0x0738,
+	0xffcf, 0xee46, 0xdcdd, 0xcd54, 0xb9eb, 0xa862, 0x9af9, 0x8b70,
+	0x8408, 0x9581, 0xa71a, 0xb693, 0xc22c, 0xd3a5, 0xe13e, 0xf0b7,
+	0x0840, 0x19c9, 0x2b52, 0x3adb, 0x4e64, 0x5fed, 0x6d76, 0x7cff,
+	0x9489, 0x8500, 0xb79b, 0xa612, 0xd2ad, 0xc324, 0xf1bf, 0xe036,
+	0x18c1, 0x0948, 0x3bd3, 0x2a5a, 0x5ee5, 0x4f6c, 0x7df7, 0x6c7e,
+	0xa50a, 0xb483, 0x8618, 0x9791, 0xe32e, 0xf2a7, 0xc03c, 0xd1b5,
+	0x2942, 0x38cb, 0x0a50, 0x1bd9, 0x6f66, 0x7eef, 0x4c74, 0x5dfd,
+	0xb58b, 0xa402, 0x9699, 0x8710, 0xf3af, 0xe226, 0xd0bd, 0xc134,
+	0x39c3, 0x284a, 0x1ad1, 0x0b58, 0x7fe7, 0x6e6e, 0x5cf5, 0x4d7c,
+	0xc60c, 0xd785, 0xe51e, 0xf497, 0x8028, 0x91a1, 0xa33a, 0xb2b3,
+	0x4a44, 0x5bcd, 0x6956, 0x78df, 0x0c60, 0x1de9, 0x2f72, 0x3efb,
+	0xd68d, 0xc704, 0xf59f, 0xe416, 0x90a9, 0x8120, 0xb3bb, 0xa232,
+	0x5ac5, 0x4b4c, 0x79d7, 0x685e, 0x1ce1, 0x0d68, 0x3ff3, 0x2e7a,
+	0xe70e, 0xf687, 0xc41c, 0xd595, 0xa12a, 0xb0a3, 0x8238, 0x93b1,
+	0x6b46, 0x7acf, 0x4854, 0x59dd, 0x2d62, 0x3ceb, 0x0e70, 0x1ff9,
+	0xf78f, 0xe606, 0xd49d, 0xc514, 0xb1ab, 0xa022, 0x92b9, 0x8330,
+	0x7bc7, 0x6a4e, 0x58d5, 0x495c, 0x3de3, 0x2c6a, 0x1ef1, 0x0f78,
+};
+
+
+
+/**
+  * @brief  计算 FCS16
+  */
+uint16_t dlms_fcs16(uint16_t fcs, const unsigned char *data, size_t size) {
+	while(size--) {
+		fcs = (fcs >> 8) ^ fcs_table[(fcs ^ *data++) & 0xff];
+	}
+
+	return fcs;
+}
+
+/**
+  * @brief  校验帧尾 FCS (低字节在前)
+  */
+static int hdlc_check(const unsigned char *data, size_t size) {
+	uint16_t fcs = ~dlms_fcs16(0xFFFF, data, size - 2);
+
+	return ((data[size - 2] == (fcs & 0xff)) && (data[size - 1] == (fcs >> 8))) ? 0 : -1;
+}
+
+/**
+  * @brief  HDLC 地址域长度，地址字节最低位为 1 表示结束，最多 4 字节
+  */
+static size_t hdlc_address(const unsigned char *data, size_t size) {
+	for(size_t n=0; (n<size) && (n<4); n++) {
+		if(data[n] & 0x01) {
+			return n + 1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+  * @brief  找到下一个可能的帧起始位置
+  */
+static long resync(const unsigned char *data, size_t size) {
+	for(size_t n=1; n<size; n++) {
+		if((data[n] == HDLC_FLAG) || (data[n] == (WRAPPER_VERSION >> 8))) {
+			return -(long)n;
+		}
+	}
+
+	return -(long)size;
+}
+
+/**
+  * @brief  计算首帧长度
+  */
+long dlms_measure(const unsigned char *data, size_t size) {
+	if(!size) {
+		return 0;
+	}
+
+	//HDLC 帧：7E | A0 LL | 地址 控制 HCS 信息 FCS | 7E
+	if(data[0] == HDLC_FLAG) {
+		size_t length;
+		if(size < 3) {
+			return 0;
+		}
+		//帧格式域高 4 位固定为 0xA，否则为帧间标志或噪声
+		if((data[1] & 0xF0) != 0xA0) {
+			return resync(data, size);
+		}
+		length = (((size_t)(data[1] & 0x07)) << 8) | data[2];
+		if((length + 2) < HDLC_MIN_SIZE) {
+			return resync(data, size);
+		}
+		if(size < (length + 2)) {
+			return (long)(length + 2);
+		}
+		//完整后校验结束标志和 FCS
+		if((data[length + 1] != HDLC_FLAG) || hdlc_check(data + 1, length)) {
+			return resync(data, size);
+		}
+		return (long)(length + 2);
+	}
+
+	//TCP wrapper：版本 0001 | 源端口 | 目的端口 | 长度 | APDU
+	if(data[0] == (WRAPPER_VERSION >> 8)) {
+		if(size < 2) {
+			return 0;
+		}
+		if(data[1] != (WRAPPER_VERSION & 0xff)) {
+			return resync(data, size);
+		}
+		if(size < WRAPPER_HEADER_SIZE) {
+			return 0;
+		}
+		return (long)(WRAPPER_HEADER_SIZE + ((((size_t)data[6]) << 8) | data[7]));
+	}
+
+	return resync(data, size);
+}
+
+/**
+  * @brief  判断 APDU 类型
+  */
+static enum __dlms_class apdu_classify(const unsigned char *apdu, size_t size) {
+	if(!size) {
+		return DLMS_KEEPALIVE;
+	}
+
+	switch(apdu[0]) {
+		case 0x60://AARQ
+		case 0x61://AARE
+		case 0x62://RLRQ
+		case 0x63://RLRE
+			return DLMS_ASSOCIATION;
+		case 0x0F://data-notification
+		case 0xC2://event-notification-request
+		case 0xCA://glo-event-notification-request
+		case 0xD2://ded-event-notification-request
+			return DLMS_EVENT;
+		default:
+			return DLMS_DATA;
+	}
+}
+
+/**
+  * @brief  判断完整帧的类型
+  */
+enum __dlms_class dlms_classify(const unsigned char *frame, size_t size) {
+	if(size < 1) {
+		return DLMS_UNKNOWN;
+	}
+
+	if(frame[0] == HDLC_FLAG) {
+		size_t dst, src, header;
+		unsigned char control;
+		const unsigned char *info;
+		size_t length;
+
+		if(size < HDLC_MIN_SIZE) {
+			return DLMS_UNKNOWN;
+		}
+		dst = hdlc_address(frame + 3, size - 3);
+		if(!dst) {
+			return DLMS_UNKNOWN;
+		}
+		src = hdlc_address(frame + 3 + dst, size - 3 - dst);
+		if(!src) {
+			return DLMS_UNKNOWN;
+		}
+		//帧格式 + 地址 + 控制
+		header = 2 + dst + src + 1;
+		if((header + 4) > size) {
+			return DLMS_UNKNOWN;
+		}
+		control = frame[header];
+		//信息域位于 HCS 之后，FCS 与结束标志之前
+		info = frame + 1 + header + 2;
+		length = (size > (1 + header + 2 + 3)) ? (size - (1 + header + 2 + 3)) : 0;
+
+		//S 帧：RR RNR
+		if((control & 0x03) == 0x01) {
+			return DLMS_KEEPALIVE;
+		}
+		//U 帧
+		if((control & 0x03) == 0x03) {
+			switch(control & 0xEF) {
+				case 0x83://SNRM
+				case 0x63://UA
+				case 0x43://DISC
+				case 0x0F://DM
+					return DLMS_ASSOCIATION;
+				case 0x03://UI
+					break;
+				default:
+					return DLMS_DATA;
+			}
+			if(!length) {
+				return DLMS_KEEPALIVE;
+			}
+		}
+		//分段帧的后续段不带 LLC 头
+		if(frame[1] & 0x08) {
+			return DLMS_DATA;
+		}
+		//跳过 LLC 头 E6 E6 00 / E6 E7 00
+		if((length >= 3) && (info[0] == 0xE6) && ((info[1] == 0xE6) || (info[1] == 0xE7)) && (info[2] == 0x00)) {
+			info += 3;
+			length -= 3;
+		}
+		return apdu_classify(info, length);
+	}
+
+	if((size >= WRAPPER_HEADER_SIZE) && (frame[0] == (WRAPPER_VERSION >> 8)) && (frame[1] == (WRAPPER_VERSION & 0xff))) {
+		return apdu_classify(frame + WRAPPER_HEADER_SIZE, size - WRAPPER_HEADER_SIZE);
+	}
+
+	return DLMS_UNKNOWN;
+}
@@ -0,0 +1,39 @@
+#ifndef __DLMS_HPP__
+#define __DLMS_HPP__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+  * @brief  最大帧长度：TCP wrapper 包头加 16 位长度 (HDLC 最长 2049 字节)
+  */
+#define DLMS_FRAME_MAX				(8 + 65535)
+
+/**
+  * @brief  DLMS 帧类型
+  */
+enum __dlms_class {
+	DLMS_UNKNOWN = 0,//无法识别
+	DLMS_ASSOCIATION,//应用连接/链路建立 AARQ AARE RLRQ RLRE SNRM UA DISC DM
+	DLMS_EVENT,//事件通知/数据通知
+	DLMS_KEEPALIVE,//链路保持 RR RNR 空UI 空wrapper
+	DLMS_DATA,//其它有效帧
+};
+
+/**
+  * @brief  计算 FCS16 (CRC-16/X.25)，初值 0xFFFF，结果需取反
+  */
+uint16_t dlms_fcs16(uint16_t fcs, const unsigned char *data, size_t size);
+
+/**
+  * @brief  计算首帧长度，支持 HDLC 与 TCP wrapper
+  * @retval >0 帧长度 (可能大于已有数据)，0 数据不足，<0 丢弃的字节数
+  */
+long dlms_measure(const unsigned char *data, size_t size);
+
+/**
+  * @brief  判断完整帧的类型
+  */
+enum __dlms_class dlms_classify(const unsigned char *frame, size_t size);
+
+#endif
@@ -0,0 +1,238 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "dlms.hpp"
+#include "dlt.hpp"
+
+#define DLT_START					0x68
+#define DLT_END						0x16
+#define DLT645_HEADER_SIZE			10
+#define DLT645_MIN_SIZE				12
+#define DLT698_MIN_SIZE				12
+
+
+
+/**
+  * @brief  645 校验和，从起始符到数据域的算术和
+  */
+static unsigned char dlt645_sum(const unsigned char *data, size_t size) {
+	unsigned int sum = 0;
+
+	while(size--) {
+		sum += *data++;
+	}
+
+	return (unsigned char)sum;
+}
+
+/**
+  * @brief  698.45 HCS/FCS 与 HDLC 相同，为 CRC-16/X.25，低字节在前
+  */
+static int dlt698_check(const unsigned char *data, size_t size) {
+	uint16_t fcs = ~dlms_fcs16(0xFFFF, data, size);
+
+	return ((data[size] == (fcs & 0xff)) && (data[size + 1] == (fcs >> 8))) ? 0 : -1;
+}
+
+/**
+  * @brief  698.45 服务器地址长度，地址标志 AF 低 4 位加 1
+  */
+static size_t dlt698_address(const unsigned char *frame) {
+	return (size_t)(frame[4] & 0x0F) + 1;
+}
+
+/**
+  * @brief  645 帧：68 | A0..A5 | 68 | C | L | DATA | CS | 16
+  * @retval >0 有效帧长度，0 数据不足，<0 不是有效帧
+  */
+static long dlt645_measure(const unsigned char *data, size_t size) {
+	size_t length;
+
+	if(size < DLT645_HEADER_SIZE) {
+		return (size > 7 && data[7] != DLT_START) ? -1 : 0;
+	}
+	if(data[7] != DLT_START) {
+		return -1;
+	}
+	length = DLT645_MIN_SIZE + data[9];
+	if(size < length) {
+		return 0;
+	}
+	if((data[length - 1] != DLT_END) || (dlt645_sum(data, length - 2) != data[length - 2])) {
+		return -1;
+	}
+
+	return (long)length;
+}
+
+/**
+  * @brief  698.45 帧：68 | L(2) | C | AF | SA | CA | HCS | APDU | FCS | 16
+  * @retval >0 有效帧长度，0 数据不足，<0 不是有效帧
+  */
+static long dlt698_measure(const unsigned char *data, size_t size) {
+	size_t length, header;
+
+	if(size < 5) {
+		return 0;
+	}
+	//长度域 bit14 为千字节单位，bit15 保留，均不支持
+	if(data[2] & 0xC0) {
+		return -1;
+	}
+	length = ((((size_t)data[2]) << 8) | data[1]) + 2;
+	//长度域 + 控制域 + AF + SA + CA
+	header = 2 + 1 + 1 + dlt698_address(data) + 1;
+	if(length < (DLT698_MIN_SIZE + dlt698_address(data) - 1)) {
+		return -1;
+	}
+	//帧头完整即校验 HCS，尽早丢弃
+	if(size >= (1 + header + 2)) {
+		if(dlt698_check(data + 1, header)) {
+			return -1;
+		}
+	}
+	if(size < length) {
+		return 0;
+	}
+	if((data[length - 1] != DLT_END) || dlt698_check(data + 1, length - 4)) {
+		return -1;
+	}
+
+	return (long)length;
+}
+
+/**
+  * @brief  找到下一个可能的起始符，跳过前导 FE
+  */
+static long resync(const unsigned char *data, size_t size) {
+	for(size_t n=1; n<size; n++) {
+		if(data[n] == DLT_START) {
+			return -(long)n;
+		}
+	}
+
+	return -(long)size;
+}
+
+/**
+  * @brief  计算首帧长度
+  */
+long dlt_measure(const unsigned char *data, size_t size) {
+	long a, b;
+
+	if(!size) {
+		return 0;
+	}
+	if(data[0] != DLT_START) {
+		return resync(data, size);
+	}
+
+	//两种规约起始符相同，按校验结果区分
+	a = dlt645_measure(data, size);
+	if(a > 0) {
+		return a;
+	}
+	b = dlt698_measure(data, size);
+	if(b > 0) {
+		return b;
+	}
+	if((a == 0) || (b == 0)) {
+		return 0;
+	}
+
+	return resync(data, size);
+}
+
+/**
+  * @brief  判断是否为 645 帧 (仅检查结构)
+  */
+static int dlt645_is(const unsigned char *frame, size_t size) {
+	return (size >= DLT645_MIN_SIZE) && (frame[7] == DLT_START) && (size == (DLT645_MIN_SIZE + (size_t)frame[9]));
+}
+
+/**
+  * @brief  判断完整帧的类型
+  */
+enum __dlt_class dlt_classify(const unsigned char *frame, size_t size) {
+	const unsigned char *apdu;
+	size_t header;
+
+	if((size < DLT645_MIN_SIZE) || (frame[0] != DLT_START) || (frame[size - 1] != DLT_END)) {
+		return DLT_UNKNOWN;
+	}
+	if(dlt645_is(frame, size)) {
+		return DLT_DATA;
+	}
+
+	//698.45 功能码 1 为链路管理，APDU 为 LINK-Request：01 | PIID-ACD | 类型 | 心跳周期 | 时间
+	header = 1 + 2 + 1 + 1 + dlt698_address(frame) + 1 + 2;
+	if((header + 3 + 3) > size) {
+		return DLT_UNKNOWN;
+	}
+	apdu = frame + header;
+	if(((frame[3] & 0x07) == 0x01) && (apdu[0] == 0x01)) {
+		switch(apdu[2]) {
+			case 0x00:
+				return DLT_LOGIN;
+			case 0x01:
+				return DLT_HEARTBEAT;
+			case 0x02:
+				return DLT_LOGOUT;
+			default:
+				break;
+		}
+	}
+
+	return DLT_DATA;
+}
+
+/**
+  * @brief  地址转为字符串，高位在前；通配 (A/F 半字节) 与全 9 广播地址无效
+  */
+static size_t dlt_name(const unsigned char *address, size_t size, char *name, size_t length) {
+	static const char hex[] = "0123456789ABCDEF";
+	int broadcast = 1;
+
+	if((size * 2 + 1) > length) {
+		return 0;
+	}
+	for(size_t n=0; n<size; n++) {
+		unsigned char c = address[size - 1 - n];
+		if(((c >> 4) > 9) || ((c & 0x0F) > 9)) {
+			return 0;
+		}
+		if(c != 0x99) {
+			broadcast = 0;
+		}
+		name[n * 2] = hex[c >> 4];
+		name[n * 2 + 1] = hex[c & 0x0F];
+	}
+	if(broadcast) {
+		return 0;
+	}
+	name[size * 2] = 0;
+
+	return size * 2;
+}
+
+/**
+  * @brief  从登录帧提取表计地址
+  */
+size_t dlt_login(const unsigned char *frame, size_t size, char *name, size_t length) {
+	switch(dlt_classify(frame, size)) {
+		case DLT_LOGIN:
+			//只接受单地址
+			if(frame[4] & 0xC0) {
+				return 0;
+			}
+			return dlt_name(frame + 5, dlt698_address(frame), name, length);
+		case DLT_DATA:
+			//645 从站正常应答：控制码 D7=1 D6=0
+			if(dlt645_is(frame, size) && ((frame[8] & 0xC0) == 0x80)) {
+				return dlt_name(frame + 1, 6, name, length);
+			}
+			return 0;
+		default:
+			return 0;
+	}
+}
@@ -0,0 +1,41 @@
+#ifndef __DLT_HPP__
+#define __DLT_HPP__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+  * @brief  最大帧长度：698.45 长度域 16 位加起始符与结束符 (645 最长 267 字节)
+  */
+#define DLT_FRAME_MAX				(65535 + 2)
+
+/**
+  * @brief  DL/T 645 / 698.45 帧类型
+  */
+enum __dlt_class {
+	DLT_UNKNOWN = 0,//无法识别
+	DLT_LOGIN,//698.45 登录
+	DLT_HEARTBEAT,//698.45 心跳
+	DLT_LOGOUT,//698.45 退出登录
+	DLT_DATA,//其它有效帧
+};
+
+/**
+  * @brief  计算首帧长度，支持 DL/T 645-2007 与 DL/T 698.45，校验错误的帧被丢弃
+  * @retval >0 帧长度 (可能大于已有数据)，0 数据不足，<0 丢弃的字节数
+  */
+long dlt_measure(const unsigned char *data, size_t size);
+
+/**
+  * @brief  判断完整帧的类型，帧须已由 dlt_measure 校验
+  */
+enum __dlt_class dlt_classify(const unsigned char *frame, size_t size);
+
+/**
+  * @brief  从登录帧提取表计地址 (高位在前的十六进制字符串)
+  *         698.45 取登录请求的服务器地址，645 取从站正常应答的表地址，通配/广播地址无效
+  * @retval 地址字符串长度，0 不是登录帧
+  */
+size_t dlt_login(const unsigned char *frame, size_t size, char *name, size_t length);
+
+#endif
@@ -1,12 +1,15 @@
 #include <iostream>
-#include <queue>
+#include <vector>
 #include <string>
 #include <cstring>
 #include <stdint.h>
+#include <errno.h>
 #include <time.h>
+#include <signal.h>
 #if defined(WIN32)
 #include <Ws2tcpip.h>
 #include <windows.h>
+#include <io.h>
 #else
 #include <arpa/inet.h>
 #include <unistd.h>
@@ -14,11 +17,45 @@
 #include "uv.h"
 #include "lua.hpp"
 #include "gather.hpp"
+#include "dlms.hpp"
+#include "dlt.hpp"
+#include "db.hpp"
 
 using namespace std;
 
 #define DEFAULT_AUTH_PACKET_SIZE		128
 #define DEFAULT_BACKLOG				128
+#define DEFAULT_TABLE_SIZE			1024
+#define DEFAULT_FRAME_SIZE			(64*1024)
+#define MAX_FRAME_SIZE				(16*1024*1024)
+#define DEFAULT_SLAB_SIZE			256
+#define DEFAULT_SCRATCH_SIZE		(64*1024)
+#define DEFAULT_RECV_MIN			(8*1024)
+#define DEFAULT_OUTQ_SIZE			256
+#define DEFAULT_RING_SIZE			4096
+#define DEFAULT_HIGH_WATERMARK		(8*1024*1024)
+#define DEFAULT_LOW_WATERMARK		(2*1024*1024)
+#define DEFAULT_STORE_MEMORY		(4*1024*1024)
+#define DEFAULT_SPOOL_SIZE			(256*1024*1024)
+#define STORE_BATCH_SIZE			(64*1024)
+#define DEFAULT_REPLAY_RATE			(8*1024*1024)
+#define STORE_INTERVAL				100
+#define PIPE_RETRY_MIN				100
+#define PIPE_RETRY_MAX				30000
+#define DEFAULT_DB_INTERVAL			200
+#define DEFAULT_SEEN_INTERVAL		30
+#define DEFAULT_CACHE_SIZE			4096
+#define DEFAULT_RETAIN_DAYS			31
+#define POOL_CLASSES				4
+#define WHEEL_BITS					8
+#define WHEEL_SIZE					(1 << WHEEL_BITS)
+#define WHEEL_MASK					(WHEEL_SIZE - 1)
+#define PROBE_INTERVAL				10
+#define PROBE_BUCKETS				24
+#define INTERN_CHUNK_BITS			12
+#define INTERN_CHUNK_SIZE			(1 << INTERN_CHUNK_BITS)
+#define INTERN_CHUNKS				(PACKET_HANDLE_MAX >> INTERN_CHUNK_BITS)
+#define PACKET_METATABLE			"gather.packet"
 
 typedef struct __uni_configs {
 	unsigned int port;
@@ -26,12 +63,34 @@ typedef struct __uni_configs {
 	unsigned long max_clients;
 	char script_registered[512*1024];
 	char script_heartbeat[512*1024];
+	char framing[256];
+	unsigned int stats;
+	unsigned int loops;
+	char sock[128];
+	size_t high_watermark;
+	size_t low_watermark;
+	char spool[160];
+	uint64_t spool_size;
+	size_t replay_rate;
+	char database[160];
+	unsigned int commit;
+	unsigned int flush;
+	uint32_t profile;
+	unsigned long cache;
+	unsigned int retain;
 } uni_configs;
 
 typedef struct __uni_runs {
 	unsigned long clients;
 	uv_connect_t *connection;
-	uv_mutex_t lock;
+	unsigned int version;
+	uint8_t handles;
+	uint32_t *defined;
+	uint32_t defined_size;
+	uv_timer_t retry;
+	unsigned int attempts;
+	unsigned long reconnects;
+	unsigned long recognized;
 } uni_runs;
 
 typedef struct __uni_write {
@@ -39,12 +98,45 @@ typedef struct __uni_write {
 	uv_buf_t buf;
 } uni_write;
 
+typedef struct __uni_batch {
+	uv_write_t req;
+	char **holds;
+	unsigned int count;
+	unsigned long tail;
+	struct __uni_frame *sources;
+	unsigned int sourced;
+	unsigned int from;
+} uni_batch;
+
 typedef struct __uni_client {
 	uv_tcp_t handle;
 	char name[32];
+	uint32_t hash;
+	uint32_t id;
+	uint32_t serial;
 	unsigned char ip[16];
 	unsigned short port;
 	time_t timestamp;
+	char *pending;
+	unsigned int pending_size;
+	unsigned int pending_capacity;
+	unsigned int refs;
+	uint8_t closed;
+	struct __uni_client *next;
+	time_t expire;
+	struct __uni_client *wheel_next;
+	struct __uni_client *wheel_prev;
+	struct __uni_client **wheel_slot;
+	uint8_t paused;
+	uint64_t paused_at;
+	time_t resumed;
+	struct __uni_client *pause_next;
+	struct __uni_client *pause_prev;
+	unsigned long bytes;
+	unsigned long window;
+	uint8_t dirty;
+	struct __uni_client *dirty_next;
+	struct __uni_client *dirty_prev;
 } uni_client;
 
 typedef struct __uni_classifier {
@@ -52,408 +144,4103 @@ typedef struct __uni_classifier {
 	uni_client *client;
 	char *packet;
 	unsigned int size;
+	char name[32];
+	int result;
 } uni_classifier;
 
+typedef struct __uni_packet {
+	const char *data;
+	size_t size;
+} uni_packet;
+
+typedef struct __uni_vm {
+	lua_State *L;
+	int registered;
+	int heartbeat;
+	int object;
+	uni_packet *packet;
+} uni_vm;
+
+enum __framer_type {
+	FRAMER_RAW = 0,//单次读取即一帧
+	FRAMER_LENGTH,//长度域
+	FRAMER_DELIMITER,//结束符
+	FRAMER_SCRIPT,//脚本描述
+	FRAMER_DLMS,//DLMS HDLC/wrapper
+	FRAMER_DLT,//DL/T 645-2007 与 DL/T 698.45
+};
+
+enum __frame_class {
+	FRAME_UNKNOWN = 0,//交由脚本判断
+	FRAME_HEARTBEAT,//心跳/链路保持
+	FRAME_DATA,//业务数据，直接上送
+};
+
+typedef struct __uni_framer {
+	enum __framer_type type;
+	unsigned int offset;
+	unsigned int width;
+	int adjust;
+	int little;
+	unsigned char delimiter[16];
+	unsigned int delimiter_size;
+	size_t limit;
+	lua_State *L;
+	int function;
+	uni_packet *packet;
+} uni_framer;
+
+typedef struct __uni_slot {
+	uint32_t hash;
+	uni_client *client;
+} uni_slot;
+
+typedef struct __uni_table {
+	uni_slot *slots;
+	unsigned long capacity;
+	unsigned long size;
+} uni_table;
+
+typedef struct __uni_block {
+	struct __uni_block *next;
+	unsigned int index;
+	unsigned int size;
+	unsigned int refs;
+} uni_block;
+
+typedef struct __uni_pool {
+	uni_block *free[POOL_CLASSES];
+	unsigned long count[POOL_CLASSES];
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long reads;
+} uni_pool;
+
+typedef struct __uni_wheel {
+	uni_client *slots[2][WHEEL_SIZE];
+	time_t tick;
+	unsigned long expired;
+	uv_timer_t timer;
+} uni_wheel;
+
+typedef struct __uni_probe {
+	uv_timer_t timer;
+	uint64_t last;
+	uint64_t max;
+	unsigned long samples;
+	unsigned long buckets[PROBE_BUCKETS];
+} uni_probe;
+
+typedef struct __uni_slab {
+	uni_client *free;
+	unsigned long total;
+	unsigned long used;
+	uni_client **blocks;
+	unsigned long count;
+} uni_slab;
+
+typedef struct __uni_head {
+	char data[PACKET_HEAD_MAX];
+} uni_head;
+
+typedef struct __uni_inq {
+	char *data;
+	size_t size;
+	size_t capacity;
+	unsigned long packets;
+} uni_inq;
+
+typedef struct __uni_frame {
+	uint64_t stamp;
+	uint32_t size;
+	unsigned int buf;
+	uint8_t flag;
+	const char *data;
+	char name[32];
+} uni_frame;
+
+typedef struct __uni_outq {
+	uv_check_t check;
+	uni_head *ring;
+	unsigned long head;
+	unsigned long tail;
+	unsigned int writing;
+	uv_buf_t *bufs;
+	unsigned int count;
+	unsigned int capacity;
+	char **holds;
+	unsigned int held;
+	unsigned int hold_capacity;
+	uni_frame *sources;
+	unsigned int sourced;
+	unsigned int source_capacity;
+	size_t size;
+	uint64_t seq;
+	unsigned long copied;
+	unsigned long frames;
+	unsigned long batches;
+	unsigned long direct;
+	unsigned long queued;
+} uni_outq;
+
+typedef struct __uni_flow {
+	uint8_t congested;
+	uint64_t since;
+	uni_client *paused;
+	unsigned long count;
+	unsigned long window;
+	unsigned long window_bytes;
+	unsigned long average;
+	unsigned long congestions;
+	unsigned long pauses;
+	uint64_t congested_ms;
+	uint64_t paused_ms;
+} uni_flow;
+
+typedef struct __uni_seen {
+	uv_timer_t timer;
+	uni_client *dirty;
+	unsigned long count;
+	unsigned long heartbeats;
+	unsigned long flushed;
+} uni_seen;
+
+typedef struct __uni_record {
+	struct __uni_record *next;
+	uint64_t stamp;
+	uint32_t size;
+	uint8_t flag;
+	char name[32];
+} uni_record;
+
+typedef struct __uni_spooled {
+	uint32_t size;
+	uint8_t flag;
+	uint8_t reserved[3];
+	uint64_t stamp;
+	char name[32];
+} uni_spooled;
+
+typedef struct __uni_store {
+	uv_timer_t timer;
+	uni_record *head;
+	uni_record *tail;
+	size_t memory;
+	char path[192];
+	FILE *writer;
+	FILE *reader;
+	uint64_t spilled;
+	unsigned long stored;
+	unsigned long spooled;
+	unsigned long replayed;
+	unsigned long dropped;
+	uint8_t burst;
+	struct __uni_record *requeued;
+	char *batch;
+	size_t batched;
+	unsigned int batch_count;
+} uni_store;
+
+typedef struct __uni_route {
+	uint32_t hash;
+	uint16_t owner;
+	uint32_t serial;
+	char name[32];
+} uni_route;
+
+typedef struct __uni_registry {
+	uni_route *slots;
+	unsigned long capacity;
+	unsigned long size;
+} uni_registry;
+
+enum __message_type {
+	MSG_BIND = 0,//登记客户端所在的事件轮询
+	MSG_UNBIND,//注销登记
+	MSG_ROUTE,//下行命令发送到登记所在的事件轮询
+	MSG_DELIVER,//下行命令发送到客户端所在的事件轮询
+	MSG_REPLY,//下行命令结果返回到收到命令的事件轮询
+	MSG_EVICT,//同名客户端在其它事件轮询注册，强制下线
+	MSG_OFFLINE,//客户端不在线，由登记所在的事件轮询按缓存返回
+	MSG_STOP,//停止事件轮询
+};
+
+typedef struct __uni_message {
+	struct __uni_message *next;
+	uint8_t type;
+	uint8_t flag;
+	uint16_t origin;
+	uint16_t owner;
+	uint32_t hash;
+	uint32_t serial;
+	char name[32];
+	unsigned int size;
+	char data[1];
+} uni_message;
+
+typedef struct __uni_name {
+	char name[32];
+	uint32_t hash;
+	uint32_t refs;
+	uint32_t generation;
+	uint32_t next;
+} uni_name;
+
+typedef struct __uni_intern {
+	uv_mutex_t lock;
+	uint32_t *slots;
+	unsigned long capacity;
+	unsigned long size;
+	uint32_t count;
+	uint32_t free;
+	unsigned long recycled;
+	unsigned long exhausted;
+	uni_name *chunks[INTERN_CHUNKS];
+} uni_intern;
+
+typedef struct __uni_waiter {
+	struct __uni_waiter *next;
+	unsigned int origin;
+} uni_waiter;
+
+enum __meta_state {
+	META_EMPTY = 0,//空闲
+	META_LOADING,//正在从数据库读取
+	META_FOUND,//数据库中有记录
+	META_MISSING,//数据库中没有记录
+};
+
+typedef struct __uni_meta {
+	char name[32];
+	uint32_t hash;
+	uint8_t state;
+	uint8_t referenced;
+	uint8_t updated;
+	packet_meta data;
+	struct __uni_meta *next;
+	uni_waiter *waiters;
+} uni_meta;
+
+typedef struct __uni_cache {
+	uni_meta *entries;
+	uni_meta **buckets;
+	unsigned long capacity;
+	unsigned long mask;
+	unsigned long used;
+	unsigned long hand;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long waits;
+	unsigned long evictions;
+} uni_cache;
+
+typedef struct __uni_known {
+	db_login *logins;
+	uint32_t *slots;
+	unsigned long capacity;
+	unsigned long count;
+} uni_known;
+
+typedef struct __uni_shard {
+	unsigned int index;
+	uv_loop_t *loop;
+	uv_thread_t thread;
+	uv_tcp_t server;
+	uv_pipe_t pipe;
+	uv_connect_t connect;
+	uint8_t stopping;
+	uv_timer_t stats;
+	uni_runs runs;
+	uni_table table;
+	uni_slab slab;
+	uni_pool pool;
+	char *recv;
+	size_t recv_used;
+	uint64_t stamp;
+	uni_wheel wheel;
+	uni_probe probe;
+	uni_framer framer;
+	uni_registry registry;
+	uv_async_t async;
+	uni_message *inbox;
+	uint32_t serial;
+	unsigned long routed;
+	uni_outq outq;
+	uni_inq inq;
+	uni_flow flow;
+	uni_store store;
+	uni_seen seen;
+	uni_cache cache;
+} uni_shard;
+
+typedef struct __uni_lookup {
+	uv_work_t req;
+	uni_shard *shard;
+	uni_meta *entry;
+	unsigned int origin;
+	char name[32];
+	int result;
+	db_meta meta;
+} uni_lookup;
+
 
 
 static uni_configs configs;
-static uni_runs runs;
-static uv_loop_t *loop;
-static queue<uni_client *> gc;
+static uni_shard *shards;
+static uni_intern intern;
+static uni_known known;
+static uv_signal_t signals[2];
+static uv_key_t vm_key;
+static uv_mutex_t vm_lock;
+static vector<uni_vm *> vms;
+
+//内存池分级大小及每级最多缓存的空闲块数量
+static const unsigned int pool_sizes[POOL_CLASSES] = {128, 1024, 8192, 65536};
+static const unsigned long pool_limits[POOL_CLASSES] = {4096, 1024, 128, 16};
+
+static void on_read(uv_stream_t *client, ssize_t nread, const uv_buf_t *buf);
+static void on_pipe_connect(uv_connect_t *connect, int status);
+static void outq_clear(uni_shard *shard);
+static void store_requeue(uni_shard *shard, uni_frame *frames, unsigned int count, unsigned int from);
+static void store_replay(uni_shard *shard);
+static void store_flush(uni_shard *shard);
+static void shard_stop(uni_shard *shard);
 
 
 
 /**
-  * @brief  获取内存
+  * @brief  句柄所属的事件轮询分片
   */
-static void alloc_buffer(uv_handle_t *handle, size_t size, uv_buf_t *buf) {
-	buf->base = (char *)malloc(size);
-	buf->len = size;
+static uni_shard *shard_of(const void *handle) {
+	return (uni_shard *)(((const uv_handle_t *)handle)->loop->data);
+}
+
+/**
+  * @brief  当前 UNIX 时间，纳秒
+  */
+static uint64_t clock_now(void) {
+	uv_timeval64_t tv;
+
+	if(uv_gettimeofday(&tv)) {
+		return 0;
+	}
+
+	return (uint64_t)tv.tv_sec * 1000000000ULL + (uint64_t)tv.tv_usec * 1000ULL;
 }
 
 
 
 /**
-  * @brief  连接已关闭
+  * @brief  计算客户端名称的散列值 (FNV-1a)
   */
-static void on_after_close(uv_handle_t *handle) {
-	free(handle);
+static uint32_t table_hash(const char *name) {
+	uint32_t hash = 2166136261U;
+
+	for(int n=0; (n<sizeof(((uni_client *)0)->name)) && name[n]; n++) {
+		hash ^= (unsigned char)name[n];
+		hash *= 16777619U;
+	}
+
+	return hash;
 }
 
 /**
-  * @brief  发送数据完成
+  * @brief  初始化在线客户端表，容量为2的幂
   */
-static void on_after_write(uv_write_t *req, int status) {
-	if (status) {
-		fprintf(stderr, "Write error %s\n", uv_strerror(status));
+static int table_init(uni_table *table, unsigned long capacity) {
+	unsigned long size = DEFAULT_TABLE_SIZE;
+
+	while(size < capacity) {
+		size <<= 1;
 	}
 
-	free(((uni_write *)req)->buf.base);
-	free(req);
+	table->slots = (uni_slot *)calloc(size, sizeof(uni_slot));
+	if(!table->slots) {
+		return -1;
+	}
+	table->capacity = size;
+	table->size = 0;
+
+	return 0;
 }
 
+/**
+  * @brief  在线客户端表扩容，使用已保存的散列值重新排布
+  */
+static int table_grow(uni_table *table) {
+	uni_slot *slots;
+	unsigned long capacity = table->capacity << 1;
+	unsigned long mask = capacity - 1;
+
+	slots = (uni_slot *)calloc(capacity, sizeof(uni_slot));
+	if(!slots) {
+		return -1;
+	}
+
+	for(unsigned long n=0; n<table->capacity; n++) {
+		if(!table->slots[n].client) {
+			continue;
+		}
+		unsigned long i = table->slots[n].hash & mask;
+		while(slots[i].client) {
+			i = (i + 1) & mask;
+		}
+		slots[i] = table->slots[n];
+	}
+
+	free(table->slots);
+	table->slots = slots;
+	table->capacity = capacity;
 
+	return 0;
+}
 
 /**
-  * @brief  管道写数据完成
+  * @brief  按名称查询在线客户端
   */
-static void pipe_after_write(uv_write_t *req, int status) {
-	if (status) {
-		fprintf(stderr, "Write error %s\n", uv_strerror(status));
+static uni_client *table_find(uni_table *table, const char *name) {
+	uint32_t hash = table_hash(name);
+	unsigned long mask = table->capacity - 1;
+
+	for(unsigned long i = hash & mask; table->slots[i].client; i = (i + 1) & mask) {
+		if((table->slots[i].hash == hash) && \
+		(strncmp(table->slots[i].client->name, name, sizeof(((uni_client *)0)->name)) == 0)) {
+			return table->slots[i].client;
+		}
 	}
 
-	free(((uni_write *)req)->buf.base);
-	free(req);
+	return (uni_client *)0;
 }
 
 /**
-  * @brief  管道写数据
+  * @brief  插入在线客户端，返回被替换的同名客户端
   */
-static void pipe_write_data(char *name, enum __flags flag, char *buffer, int size) {
-	uni_write *req;
-	packet_header header;
-	int rc;
-	if(!runs.connection) {
-		return;
+static uni_client *table_insert(uni_table *table, uni_client *client) {
+	unsigned long mask;
+	unsigned long i;
+
+	//负载超过 3/4 时扩容
+	if(((table->size + 1) * 4) > (table->capacity * 3)) {
+		if(table_grow(table)) {
+			fprintf(stderr, "No memory for client table\n");
+		}
+	}
+
+	mask = table->capacity - 1;
+	for(i = client->hash & mask; table->slots[i].client; i = (i + 1) & mask) {
+		if((table->slots[i].hash == client->hash) && \
+		(strncmp(table->slots[i].client->name, client->name, sizeof(client->name)) == 0)) {
+			uni_client *replaced = table->slots[i].client;
+			table->slots[i].client = client;
+			return replaced;
+		}
 	}
 
-	req = (uni_write *)malloc(sizeof(*req));
-	if(!req) {
+	table->slots[i].hash = client->hash;
+	table->slots[i].client = client;
+	table->size += 1;
+
+	return (uni_client *)0;
+}
+
+/**
+  * @brief  移除在线客户端，仅当表项仍指向该客户端时生效
+  */
+static void table_remove(uni_table *table, uni_client *client) {
+	unsigned long mask = table->capacity - 1;
+	unsigned long i;
+
+	if(!client->name[0]) {
 		return;
 	}
 
-	req->buf.base = (char *)malloc(sizeof(header) + size);
-	if(!req) {
-		free(req);
+	for(i = client->hash & mask; table->slots[i].client; i = (i + 1) & mask) {
+		if(table->slots[i].client == client) {
+			break;
+		}
+	}
+	if(!table->slots[i].client) {
 		return;
 	}
-	req->buf.len = sizeof(header) + size;
 
-	//拷贝头
-	memset(&header, 0, sizeof(header));
-	header.id = time(NULL);
-	strcpy(header.name, name);
-	header.flag = (uint8_t)flag;
-	memcpy(req->buf.base, &header, sizeof(header));
-	//拷贝数据
-	if(size > 0) {
-		memcpy((void *)(sizeof(header) + ((uint64_t)(req->buf.base))), buffer, size);
+	//后移删除，保持探测链连续
+	for(unsigned long j = (i + 1) & mask; table->slots[j].client; j = (j + 1) & mask) {
+		unsigned long home = table->slots[j].hash & mask;
+		if(((j > i) && ((home <= i) || (home > j))) || \
+		((j < i) && ((home <= i) && (home > j)))) {
+			table->slots[i] = table->slots[j];
+			i = j;
+		}
 	}
-	if(rc = uv_write((uv_write_t *)req, runs.connection->handle, &req->buf, 1, pipe_after_write)) {
-		fprintf(stderr, "uv_write failed: %s", uv_strerror(rc));
+
+	table->slots[i].client = (uni_client *)0;
+	table->size -= 1;
+}
+
+
+
+/**
+  * @brief  按句柄获取名称表项，表项所在的块不会移动，可在任意线程中读取
+  *         句柄没有引用后可被其它名称复用，只有持有引用的线程可以直接读取名称
+  */
+static uni_name *intern_name(uint32_t id) {
+	uni_name *chunk;
+
+	if(!id || (id >= __atomic_load_n(&intern.count, __ATOMIC_ACQUIRE))) {
+		return (uni_name *)0;
 	}
+	chunk = __atomic_load_n(&intern.chunks[id >> INTERN_CHUNK_BITS], __ATOMIC_ACQUIRE);
+
+	return &chunk[id & (INTERN_CHUNK_SIZE - 1)];
 }
 
 /**
-  * @brief  管道读数据
+  * @brief  名称表扩容
   */
-static void pipe_on_read(uv_stream_t *client, ssize_t nread, const uv_buf_t *buf) {
-	int rc;
-	packet_header header;
-	uv_stream_t dest;
+static int intern_grow(void) {
+	unsigned long capacity = intern.capacity ? (intern.capacity << 1) : DEFAULT_TABLE_SIZE;
+	unsigned long mask = capacity - 1;
+	uint32_t *slots = (uint32_t *)calloc(capacity, sizeof(uint32_t));
 
-	//有数据报文待读取
-	if(nread > 0) {
-		//查询对应客户端并发送数据
-		if(nread < sizeof(packet_header)) {
-			free(buf->base);
-			return;
+	if(!slots) {
+		return -1;
+	}
+	for(unsigned long n=0; n<intern.capacity; n++) {
+		if(!intern.slots[n]) {
+			continue;
 		}
+		unsigned long i = intern_name(intern.slots[n])->hash & mask;
+		while(slots[i]) {
+			i = (i + 1) & mask;
+		}
+		slots[i] = intern.slots[n];
+	}
 
-		memcpy(&header, buf->base, sizeof(packet_header));
+	free(intern.slots);
+	intern.slots = slots;
+	intern.capacity = capacity;
 
-		//...使用 header.name 查询客户端信息
-		if(0) {
-			//返回未查询到对应客户端
-			pipe_write_data(header.name, RE_OFFLINE, NULL, 0);
-			fprintf(stderr, "Client not in map\n");
-			free(buf->base);
-			return;
+	return 0;
+}
+
+/**
+  * @brief  为名称分配32位句柄并增加引用，名称有引用期间始终得到同一句柄，只在注册时调用
+  *         优先复用没有引用的句柄，复用时表项的 generation 改变，上行管道重新附带名称
+  * @retval 句柄，0 失败 (名称表已满时以名称上送)
+  */
+static uint32_t intern_handle(const char *name) {
+	uint32_t hash = table_hash(name);
+	uint32_t id = 0;
+	uni_name *entry;
+	unsigned long mask, i;
+
+	uv_mutex_lock(&intern.lock);
+	if(((intern.size + 1) * 2 > intern.capacity) && intern_grow()) {
+		uv_mutex_unlock(&intern.lock);
+		return 0;
+	}
+
+	mask = intern.capacity - 1;
+	for(i = hash & mask; intern.slots[i]; i = (i + 1) & mask) {
+		entry = intern_name(intern.slots[i]);
+		if((entry->hash == hash) && (strncmp(entry->name, name, sizeof(entry->name)) == 0)) {
+			entry->refs += 1;
+			uv_mutex_unlock(&intern.lock);
+			return intern.slots[i];
 		}
-		//判断命令
-		if(header.flag == (uint8_t)PH_QUERY) {
-			//返回客户端在线
-			pipe_write_data(header.name, RE_ONLINE, NULL, 0);
-			free(buf->base);
-			return;
+	}
+
+	if(intern.free) {
+		//复用没有引用的句柄
+		id = intern.free;
+		entry = intern_name(id);
+		intern.free = entry->next;
+		intern.recycled += 1;
+	}
+	else if((intern.count >> INTERN_CHUNK_BITS) < INTERN_CHUNKS) {
+		uni_name *chunk = intern.chunks[intern.count >> INTERN_CHUNK_BITS];
+		if(!chunk) {
+			chunk = (uni_name *)calloc(INTERN_CHUNK_SIZE, sizeof(uni_name));
+			if(chunk) {
+				__atomic_store_n(&intern.chunks[intern.count >> INTERN_CHUNK_BITS], chunk, __ATOMIC_RELEASE);
+			}
 		}
-		else if(header.flag == (uint8_t)PH_REJECT) {
-			//返回已强制下线客户端
-			pipe_write_data(header.name, RE_OK, NULL, 0);
-			free(buf->base);
-			return;
+		if(chunk) {
+			id = intern.count;
+			entry = &chunk[id & (INTERN_CHUNK_SIZE - 1)];
+			//表项写入后再发布句柄
+			__atomic_store_n(&intern.count, intern.count + 1, __ATOMIC_RELEASE);
 		}
-		else if(header.flag == (uint8_t)PH_TRANSMIT) {
-			//开始发送数据到客户端
-			uni_write *wreq = (uni_write *)malloc(sizeof(uni_write));
-			if(!wreq) {
-				pipe_write_data(header.name, RE_FAILD, NULL, 0);
-				free(buf->base);
-				return;
-			}
-			wreq->buf.base = (char *)malloc(nread - sizeof(packet_header));
-			if(!(wreq->buf.base)) {
-				pipe_write_data(header.name, RE_FAILD, NULL, 0);
-				free(wreq);
-				free(buf->base);
-				return;
-			}
-			wreq->buf.len = nread - sizeof(packet_header);
-			memcpy(wreq->buf.base, buf->base + sizeof(packet_header), nread - sizeof(packet_header));
-			if(rc = uv_write((uv_write_t *)wreq, &dest, &wreq->buf, 1, on_after_write)) {
-				pipe_write_data(header.name, RE_FAILD, NULL, 0);
-				free(wreq);
-				free(buf->base);
-				fprintf(stderr, "uv_write failed: %s", uv_strerror(rc));
-				return;
-			}
+	}
+	else {
+		intern.exhausted += 1;
+	}
 
-			//返回数据发送成功
-			pipe_write_data(header.name, RE_OK, NULL, 0);
-			free(buf->base);
-			return;
-		}
+	if(id) {
+		strncpy(entry->name, name, sizeof(entry->name) - 1);
+		entry->name[sizeof(entry->name) - 1] = 0;
+		entry->hash = hash;
+		entry->refs = 1;
+		entry->next = 0;
+		//0 表示未发送过名称
+		entry->generation = (entry->generation + 1) ? (entry->generation + 1) : 1;
+		intern.slots[i] = id;
+		intern.size += 1;
 	}
-	else if (nread < 0) {
-		if (nread != UV_EOF) {
-			fprintf(stderr, "Read pipe error %s\n", uv_err_name(nread));
-			uv_close((uv_handle_t *)client, NULL);
+	uv_mutex_unlock(&intern.lock);
+
+	return id;
+}
+
+/**
+  * @brief  释放句柄的引用，没有引用时从名称表中移除，句柄放入空闲链表
+  */
+static void intern_release(uint32_t id) {
+	uni_name *entry = intern_name(id);
+	unsigned long mask, i;
+
+	if(!entry) {
+		return;
+	}
+
+	uv_mutex_lock(&intern.lock);
+	if(--entry->refs) {
+		uv_mutex_unlock(&intern.lock);
+		return;
+	}
+
+	mask = intern.capacity - 1;
+	for(i = entry->hash & mask; intern.slots[i] && (intern.slots[i] != id); i = (i + 1) & mask);
+	if(intern.slots[i]) {
+		//后移删除，保持探测链连续
+		for(unsigned long j = (i + 1) & mask; intern.slots[j]; j = (j + 1) & mask) {
+			unsigned long home = intern_name(intern.slots[j])->hash & mask;
+			if(((j > i) && ((home <= i) || (home > j))) || \
+			((j < i) && ((home <= i) && (home > j)))) {
+				intern.slots[i] = intern.slots[j];
+				i = j;
+			}
 		}
+		intern.slots[i] = 0;
+		intern.size -= 1;
+	}
+	entry->next = intern.free;
+	intern.free = id;
+	uv_mutex_unlock(&intern.lock);
+}
+
+/**
+  * @brief  按下行报文中的句柄复制名称，用于不持有引用的线程
+  *         句柄含编号与代数，编号已释放或已被其它名称复用时代数不同，不按编号猜测名称
+  * @retval 0 成功，-1 句柄无效、已释放或已复用
+  */
+static int intern_copy(uint32_t handle, char *name, size_t length) {
+	uint32_t id = PACKET_HANDLE_INDEX(handle);
+	uni_name *entry = intern_name(id);
+	int rc = -1;
+
+	if(!entry) {
+		return -1;
+	}
+	uv_mutex_lock(&intern.lock);
+	if(entry->refs && (PACKET_HANDLE_MAKE(id, entry->generation) == handle) && (strlen(entry->name) < length)) {
+		strcpy(name, entry->name);
+		rc = 0;
 	}
+	uv_mutex_unlock(&intern.lock);
 
-	free(buf->base);
+	return rc;
 }
 
 /**
-  * @brief  管道建立
+  * @brief  初始化名称表，句柄 0 保留
   */
-static void on_pipe_connect(uv_connect_t *connect, int status) {
+static int intern_init(void) {
 	int rc;
-	runs.connection = (uv_connect_t *)0;
-	if(status < 0) {
-		fprintf(stderr, "Invalid pipe connection.");
+
+	if((rc = uv_mutex_init(&intern.lock))) {
+		fprintf(stderr, "uv_mutex_init failed %s\n", uv_strerror(rc));
+		return -1;
 	}
-	else {
-		runs.connection = connect;
-		if(rc = uv_read_start(runs.connection->handle, alloc_buffer, pipe_on_read)) {
-			fprintf(stderr, "uv_read_start failed: %s", uv_strerror(rc));
-		}
+	intern.count = 1;
+
+	return intern_grow();
+}
+
+/**
+  * @brief  释放名称表
+  */
+static void intern_close(void) {
+	for(unsigned int n=0; n<INTERN_CHUNKS; n++) {
+		free(intern.chunks[n]);
 	}
+	free(intern.slots);
+	uv_mutex_destroy(&intern.lock);
 }
 
 
 
 /**
-  * @brief  注册报文判断完成
+  * @brief  计算报文的散列值 (FNV-1a)
   */
-static void on_after_register(uv_work_t *req, int status) {
-	free(((uni_classifier *)req)->packet);
-	free(req);
+static uint32_t known_hash(const char *data, size_t size) {
+	uint32_t hash = 2166136261U;
+
+	for(size_t n=0; n<size; n++) {
+		hash ^= (unsigned char)data[n];
+		hash *= 16777619U;
+	}
+
+	return hash;
 }
 
 /**
-  * @brief  注册报文判断
+  * @brief  载入上次运行保存的登录帧，启动后只读，各事件轮询无锁查找
+  *         分帧方式或注册脚本改变后 profile 不同，之前的登录帧不再使用
   */
-static void on_register(uv_work_t *req) {
-	//新建虚拟机实例
-	lua_State *L = luaL_newstate();
-	if(!L) {
-		return;
+static int known_init(void) {
+	unsigned long size = DEFAULT_TABLE_SIZE;
+
+	known.logins = db_logins(configs.profile, &known.count);
+	if(!known.logins) {
+		known.count = 0;
+		return 0;
 	}
-	//初始化虚拟机
-	luaL_openlibs(L);
-	//传入报文
-	lua_newtable(L);
-	lua_pushnumber(L, -1);
-	lua_rawseti(L, -2, 0);
-	for(int n=0; n<((uni_classifier *)req)->size; n++) {
-		lua_pushinteger(L, ((uni_classifier *)req)->packet[n]);
-		lua_rawseti(L, -2, n+1);
-	}
-	lua_setglobal(L, "packet");
-	//执行脚本
-	luaL_dostring(L, configs.script_registered);
-	//获取返回值
-	char *result = (char *)lua_tostring(L, -1);
-	if(result && (strlen(result) > 0) && (strlen(result) < sizeof(((uni_classifier *)req)->client->name))) {
-		//写入客户端名称
-		strcpy(((uni_classifier *)req)->client->name, result);
-	}
-	//关闭虚拟机实例
-	lua_close(L);
+
+	while(size < (known.count * 2)) {
+		size <<= 1;
+	}
+	known.slots = (uint32_t *)calloc(size, sizeof(uint32_t));
+	if(!known.slots) {
+		free(known.logins);
+		known.logins = (db_login *)0;
+		known.count = 0;
+		return -1;
+	}
+	known.capacity = size;
+
+	//槽中保存下标 + 1，0 为空槽
+	for(unsigned long n=0; n<known.count; n++) {
+		unsigned long i = known_hash(known.logins[n].frame, known.logins[n].size) & (known.capacity - 1);
+		while(known.slots[i]) {
+			i = (i + 1) & (known.capacity - 1);
+		}
+		known.slots[i] = (uint32_t)(n + 1);
+	}
+
+	return 0;
 }
 
 /**
-  * @brief  心跳报文判断完成
+  * @brief  按登录帧查找已知的表计名称，逐字节比较，不同的报文不会误判
   */
-static void on_after_heartbeat(uv_work_t *req, int status) {
-	free(((uni_classifier *)req)->packet);
-	free(req);
+static const char *known_find(const char *data, size_t size) {
+	unsigned long i;
+
+	if(!known.count) {
+		return (const char *)0;
+	}
+
+	i = known_hash(data, size) & (known.capacity - 1);
+	while(known.slots[i]) {
+		const db_login *login = &known.logins[known.slots[i] - 1];
+		if((login->size == size) && !memcmp(login->frame, data, size)) {
+			return login->name;
+		}
+		i = (i + 1) & (known.capacity - 1);
+	}
+
+	return (const char *)0;
+}
+
+/**
+  * @brief  释放已知登录帧表
+  */
+static void known_close(void) {
+	free(known.logins);
+	free(known.slots);
+	memset(&known, 0, sizeof(known));
+}
+
+/**
+  * @brief  初始化客户端登记表，按名称散列值分片，每个事件轮询只保存自己负责的部分
+  */
+static int registry_init(uni_registry *registry, unsigned long capacity) {
+	unsigned long size = DEFAULT_TABLE_SIZE;
+
+	while(size < capacity) {
+		size <<= 1;
+	}
+
+	registry->slots = (uni_route *)calloc(size, sizeof(uni_route));
+	if(!registry->slots) {
+		return -1;
+	}
+	registry->capacity = size;
+	registry->size = 0;
+
+	return 0;
 }
 
-/**
-  * @brief  心跳报文判断
-  */
-static void on_heartbeat(uv_work_t *req) {
-	//新建虚拟机实例
-	lua_State *L = luaL_newstate();
-	if(!L) {
-		return;
+/**
+  * @brief  客户端登记表扩容
+  */
+static int registry_grow(uni_registry *registry) {
+	uni_route *slots;
+	unsigned long capacity = registry->capacity << 1;
+	unsigned long mask = capacity - 1;
+
+	slots = (uni_route *)calloc(capacity, sizeof(uni_route));
+	if(!slots) {
+		return -1;
+	}
+
+	for(unsigned long n=0; n<registry->capacity; n++) {
+		if(!registry->slots[n].name[0]) {
+			continue;
+		}
+		unsigned long i = registry->slots[n].hash & mask;
+		while(slots[i].name[0]) {
+			i = (i + 1) & mask;
+		}
+		slots[i] = registry->slots[n];
+	}
+
+	free(registry->slots);
+	registry->slots = slots;
+	registry->capacity = capacity;
+
+	return 0;
+}
+
+/**
+  * @brief  查询客户端所在的事件轮询
+  */
+static uni_route *registry_find(uni_registry *registry, const char *name, uint32_t hash) {
+	unsigned long mask = registry->capacity - 1;
+
+	for(unsigned long i = hash & mask; registry->slots[i].name[0]; i = (i + 1) & mask) {
+		if((registry->slots[i].hash == hash) && \
+		(strncmp(registry->slots[i].name, name, sizeof(registry->slots[i].name)) == 0)) {
+			return &registry->slots[i];
+		}
+	}
+
+	return (uni_route *)0;
+}
+
+/**
+  * @brief  登记客户端所在的事件轮询及其注册序号，返回原来所在的事件轮询，未登记返回 -1
+  *         replaced 返回原来登记的注册序号
+  */
+static int registry_set(uni_registry *registry, const char *name, uint32_t hash, unsigned int owner, uint32_t serial, uint32_t *replaced) {
+	uni_route *route = registry_find(registry, name, hash);
+	unsigned long mask;
+	unsigned long i;
+
+	if(route) {
+		int previous = route->owner;
+		*replaced = route->serial;
+		route->owner = (uint16_t)owner;
+		route->serial = serial;
+		return previous;
+	}
+
+	//负载超过 3/4 时扩容
+	if(((registry->size + 1) * 4) > (registry->capacity * 3)) {
+		if(registry_grow(registry)) {
+			fprintf(stderr, "No memory for client registry\n");
+		}
+	}
+
+	mask = registry->capacity - 1;
+	for(i = hash & mask; registry->slots[i].name[0]; i = (i + 1) & mask);
+	registry->slots[i].hash = hash;
+	registry->slots[i].owner = (uint16_t)owner;
+	registry->slots[i].serial = serial;
+	strncpy(registry->slots[i].name, name, sizeof(registry->slots[i].name) - 1);
+	registry->size += 1;
+
+	return -1;
+}
+
+/**
+  * @brief  注销登记，仅当登记仍指向该事件轮询中的同一次注册时生效
+  */
+static void registry_unset(uni_registry *registry, const char *name, uint32_t hash, unsigned int owner, uint32_t serial) {
+	uni_route *route = registry_find(registry, name, hash);
+	unsigned long mask = registry->capacity - 1;
+	unsigned long i;
+
+	if(!route || (route->owner != owner) || (route->serial != serial)) {
+		return;
+	}
+	i = route - registry->slots;
+
+	//后移删除，保持探测链连续
+	for(unsigned long j = (i + 1) & mask; registry->slots[j].name[0]; j = (j + 1) & mask) {
+		unsigned long home = registry->slots[j].hash & mask;
+		if(((j > i) && ((home <= i) || (home > j))) || \
+		((j < i) && ((home <= i) && (home > j)))) {
+			registry->slots[i] = registry->slots[j];
+			i = j;
+		}
+	}
+
+	registry->slots[i].name[0] = 0;
+	registry->size -= 1;
+}
+
+
+
+/**
+  * @brief  初始化不在线客户端的状态缓存，固定容量，按 CLOCK 算法淘汰
+  */
+static int cache_init(uni_cache *cache, unsigned long capacity) {
+	unsigned long size = 1;
+
+	while(size < capacity) {
+		size <<= 1;
+	}
+	cache->entries = (uni_meta *)calloc(capacity, sizeof(uni_meta));
+	cache->buckets = (uni_meta **)calloc(size, sizeof(uni_meta *));
+	if(!cache->entries || !cache->buckets) {
+		free(cache->entries);
+		free(cache->buckets);
+		cache->entries = (uni_meta *)0;
+		cache->buckets = (uni_meta **)0;
+		return -1;
+	}
+	cache->capacity = capacity;
+	cache->mask = size - 1;
+
+	return 0;
+}
+
+/**
+  * @brief  查找缓存项，命中时标记为最近使用
+  */
+static uni_meta *cache_find(uni_cache *cache, const char *name, uint32_t hash) {
+	uni_meta *entry;
+
+	if(!cache->capacity) {
+		return (uni_meta *)0;
+	}
+	for(entry = cache->buckets[hash & cache->mask]; entry; entry = entry->next) {
+		if((entry->hash == hash) && !strcmp(entry->name, name)) {
+			entry->referenced = 1;
+			return entry;
+		}
+	}
+
+	return (uni_meta *)0;
+}
+
+/**
+  * @brief  缓存项移出散列链
+  */
+static void cache_unlink(uni_cache *cache, uni_meta *entry) {
+	uni_meta **link = &cache->buckets[entry->hash & cache->mask];
+
+	while(*link) {
+		if(*link == entry) {
+			*link = entry->next;
+			break;
+		}
+		link = &(*link)->next;
+	}
+	entry->state = META_EMPTY;
+	entry->next = (uni_meta *)0;
+}
+
+/**
+  * @brief  分配缓存项，已满时淘汰最近未使用的项，正在读取的项不淘汰
+  */
+static uni_meta *cache_take(uni_cache *cache, const char *name, uint32_t hash) {
+	uni_meta *entry = (uni_meta *)0;
+
+	if(cache->used < cache->capacity) {
+		entry = &cache->entries[cache->used];
+		cache->used += 1;
+	}
+	else {
+		//最多扫描两圈，第一圈清除使用标记
+		for(unsigned long n=0; n<(cache->capacity * 2); n++) {
+			uni_meta *candidate = &cache->entries[cache->hand];
+			cache->hand = (cache->hand + 1) % cache->capacity;
+			if(candidate->state == META_LOADING) {
+				continue;
+			}
+			if(candidate->referenced) {
+				candidate->referenced = 0;
+				continue;
+			}
+			if(candidate->state != META_EMPTY) {
+				cache_unlink(cache, candidate);
+				cache->evictions += 1;
+			}
+			entry = candidate;
+			break;
+		}
+		if(!entry) {
+			return (uni_meta *)0;
+		}
+	}
+
+	memset(entry, 0, sizeof(uni_meta));
+	strcpy(entry->name, name);
+	entry->hash = hash;
+	entry->referenced = 1;
+	entry->next = cache->buckets[hash & cache->mask];
+	cache->buckets[hash & cache->mask] = entry;
+
+	return entry;
+}
+
+/**
+  * @brief  客户端下线时更新已缓存的状态，正在读取的项以此为准
+  */
+static void cache_update(uni_cache *cache, const char *name, uint32_t hash, const packet_meta *meta) {
+	uni_meta *entry = cache_find(cache, name, hash);
+
+	if(!entry) {
+		return;
+	}
+	memcpy(&entry->data, meta, sizeof(packet_meta));
+	if(entry->state == META_LOADING) {
+		entry->updated = 1;
+	}
+	else {
+		entry->state = META_FOUND;
+	}
+}
+
+/**
+  * @brief  释放缓存
+  */
+static void cache_close(uni_cache *cache) {
+	for(unsigned long n=0; n<cache->used; n++) {
+		while(cache->entries[n].waiters) {
+			uni_waiter *waiter = cache->entries[n].waiters;
+			cache->entries[n].waiters = waiter->next;
+			free(waiter);
+		}
+	}
+	free(cache->entries);
+	free(cache->buckets);
+	memset(cache, 0, sizeof(uni_cache));
+}
+
+
+
+/**
+  * @brief  生成事件轮询间消息
+  */
+static uni_message *message_new(enum __message_type type, const char *name, uint32_t hash, const char *data, unsigned int size) {
+	uni_message *msg = (uni_message *)malloc(sizeof(uni_message) + size);
+	if(!msg) {
+		fprintf(stderr, "No memory for message\n");
+		return (uni_message *)0;
+	}
+
+	memset(msg, 0, sizeof(uni_message));
+	msg->type = (uint8_t)type;
+	msg->hash = hash;
+	strncpy(msg->name, name, sizeof(msg->name) - 1);
+	msg->size = size;
+	if(size) {
+		memcpy(msg->data, data, size);
+	}
+
+	return msg;
+}
+
+/**
+  * @brief  消息放入目标事件轮询的收件队列 (无锁多生产者单消费者栈)，并唤醒目标事件轮询
+  *         同一轮询周期内的多条消息只唤醒一次，由目标批量取出
+  */
+static void shard_post(unsigned int index, uni_message *msg) {
+	uni_shard *shard = &shards[index];
+	uni_message *head = __atomic_load_n(&shard->inbox, __ATOMIC_RELAXED);
+
+	do {
+		msg->next = head;
+	} while(!__atomic_compare_exchange_n(&shard->inbox, &head, msg, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	uv_async_send(&shard->async);
+}
+
+/**
+  * @brief  名称登记所在的事件轮询
+  */
+static unsigned int route_home(uint32_t hash) {
+	return hash % configs.loops;
+}
+
+/**
+  * @brief  客户端下线，注销登记，并更新登记所在事件轮询中缓存的状态
+  */
+static void route_unbind(uni_shard *shard, const char *name, uint32_t hash, uint32_t serial, const packet_meta *meta) {
+	unsigned int home;
+
+	if(configs.loops < 2) {
+		cache_update(&shard->cache, name, hash, meta);
+		return;
+	}
+
+	home = route_home(hash);
+	if(home == shard->index) {
+		registry_unset(&shard->registry, name, hash, shard->index, serial);
+		cache_update(&shard->cache, name, hash, meta);
+	}
+	else {
+		uni_message *msg = message_new(MSG_UNBIND, name, hash, (const char *)meta, sizeof(packet_meta));
+		if(msg) {
+			msg->owner = (uint16_t)shard->index;
+			msg->serial = serial;
+			shard_post(home, msg);
+		}
+	}
+}
+
+
+
+/**
+  * @brief  客户端内存池扩容，一次分配 DEFAULT_SLAB_SIZE 个客户端并串入空闲链表
+  */
+static int slab_grow(uni_slab *slab) {
+	uni_client *block = (uni_client *)malloc(DEFAULT_SLAB_SIZE * sizeof(uni_client));
+	uni_client **blocks;
+	if(!block) {
+		return -1;
+	}
+
+	//先登记内存块，失败时空闲链表保持不变
+	blocks = (uni_client **)realloc(slab->blocks, (slab->count + 1) * sizeof(uni_client *));
+	if(!blocks) {
+		free(block);
+		return -1;
+	}
+	for(int n=DEFAULT_SLAB_SIZE-1; n>=0; n--) {
+		block[n].next = slab->free;
+		slab->free = &block[n];
+	}
+	blocks[slab->count] = block;
+	slab->blocks = blocks;
+	slab->count += 1;
+	slab->total += DEFAULT_SLAB_SIZE;
+
+	return 0;
+}
+
+/**
+  * @brief  初始化客户端内存池，预分配 capacity 个客户端
+  */
+static int slab_init(uni_slab *slab, unsigned long capacity) {
+	memset(slab, 0, sizeof(*slab));
+
+	while(slab->total < capacity) {
+		if(slab_grow(slab)) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+  * @brief  从内存池获取客户端
+  */
+static uni_client *slab_alloc(uni_slab *slab) {
+	uni_client *client;
+
+	if(!slab->free && slab_grow(slab)) {
+		return (uni_client *)0;
+	}
+
+	client = slab->free;
+	slab->free = client->next;
+	slab->used += 1;
+	memset(client, 0, sizeof(*client));
+
+	return client;
+}
+
+/**
+  * @brief  客户端归还内存池
+  */
+static void slab_free(uni_slab *slab, uni_client *client) {
+	client->next = slab->free;
+	slab->free = client;
+	slab->used -= 1;
+}
+
+/**
+  * @brief  释放内存池
+  */
+static void slab_close(uni_slab *slab) {
+	for(unsigned long n=0; n<slab->count; n++) {
+		free(slab->blocks[n]);
+	}
+	free(slab->blocks);
+	memset(slab, 0, sizeof(*slab));
+}
+
+
+
+/**
+  * @brief  客户端加入时间轮，expire 为超时时刻 (秒)
+  *         第一级每格 1 秒共 WHEEL_SIZE 格，第二级每格 WHEEL_SIZE 秒，超出范围的放在最远一格，到期后重新计算
+  */
+static void wheel_insert(uni_wheel *wheel, uni_client *client, time_t expire) {
+	uni_client **slot;
+
+	if(expire <= wheel->tick) {
+		expire = wheel->tick + 1;
+	}
+
+	if((expire - wheel->tick) < WHEEL_SIZE) {
+		slot = &wheel->slots[0][expire & WHEEL_MASK];
+	}
+	else {
+		time_t delta = (expire >> WHEEL_BITS) - (wheel->tick >> WHEEL_BITS);
+		if(delta >= WHEEL_SIZE) {
+			expire = ((wheel->tick >> WHEEL_BITS) + WHEEL_SIZE - 1) << WHEEL_BITS;
+		}
+		slot = &wheel->slots[1][(expire >> WHEEL_BITS) & WHEEL_MASK];
+	}
+
+	client->expire = expire;
+	client->wheel_slot = slot;
+	client->wheel_prev = (uni_client *)0;
+	client->wheel_next = *slot;
+	if(*slot) {
+		(*slot)->wheel_prev = client;
+	}
+	*slot = client;
+}
+
+/**
+  * @brief  客户端移出时间轮
+  */
+static void wheel_remove(uni_client *client) {
+	if(!client->wheel_slot) {
+		return;
+	}
+
+	if(client->wheel_prev) {
+		client->wheel_prev->wheel_next = client->wheel_next;
+	}
+	else {
+		*client->wheel_slot = client->wheel_next;
+	}
+	if(client->wheel_next) {
+		client->wheel_next->wheel_prev = client->wheel_prev;
+	}
+	client->wheel_next = (uni_client *)0;
+	client->wheel_prev = (uni_client *)0;
+	client->wheel_slot = (uni_client **)0;
+}
+
+/**
+  * @brief  取出一格的全部客户端
+  */
+static uni_client *wheel_take(uni_client **slot) {
+	uni_client *list = *slot;
+
+	*slot = (uni_client *)0;
+	for(uni_client *c=list; c; c=c->wheel_next) {
+		c->wheel_slot = (uni_client **)0;
+	}
+
+	return list;
+}
+
+
+
+/**
+  * @brief  从分级内存池获取内存，超过最大分级时直接分配
+  */
+static char *pool_alloc(uni_pool *pool, size_t size) {
+	uni_block *block;
+	unsigned int index;
+
+	for(index=0; index<POOL_CLASSES; index++) {
+		if(size <= pool_sizes[index]) {
+			break;
+		}
+	}
+
+	if((index < POOL_CLASSES) && pool->free[index]) {
+		block = pool->free[index];
+		pool->free[index] = block->next;
+		pool->count[index] -= 1;
+		pool->hits += 1;
+		block->refs = 1;
+		return (char *)(block + 1);
+	}
+
+	if(index < POOL_CLASSES) {
+		size = pool_sizes[index];
+	}
+	block = (uni_block *)malloc(sizeof(uni_block) + size);
+	if(!block) {
+		return (char *)0;
+	}
+	block->index = index;
+	block->size = (unsigned int)size;
+	block->refs = 1;
+	pool->misses += 1;
+
+	return (char *)(block + 1);
+}
+
+/**
+  * @brief  内存块的可用大小
+  */
+static size_t pool_capacity(const char *data) {
+	return (((const uni_block *)data) - 1)->size;
+}
+
+/**
+  * @brief  增加内存块的引用
+  */
+static void pool_ref(char *data) {
+	(((uni_block *)data) - 1)->refs += 1;
+}
+
+/**
+  * @brief  内存块的引用数量
+  */
+static unsigned int pool_refs(const char *data) {
+	return (((const uni_block *)data) - 1)->refs;
+}
+
+/**
+  * @brief  释放一个引用，没有引用时归还内存池，空闲块超过上限时释放
+  */
+static void pool_free(uni_pool *pool, char *data) {
+	uni_block *block;
+
+	if(!data) {
+		return;
+	}
+
+	block = ((uni_block *)data) - 1;
+	if(--block->refs) {
+		return;
+	}
+	if((block->index >= POOL_CLASSES) || (pool->count[block->index] >= pool_limits[block->index])) {
+		free(block);
+		return;
+	}
+	block->next = pool->free[block->index];
+	pool->free[block->index] = block;
+	pool->count[block->index] += 1;
+}
+
+/**
+  * @brief  释放内存池
+  */
+static void pool_close(uni_pool *pool) {
+	for(unsigned int index=0; index<POOL_CLASSES; index++) {
+		while(pool->free[index]) {
+			uni_block *block = pool->free[index];
+			pool->free[index] = block->next;
+			free(block);
+		}
+		pool->count[index] = 0;
+	}
+}
+
+/**
+  * @brief  获取内存
+  *         所有连接依次使用同一块接收缓冲区，上行队列直接引用其中的报文，
+  *         被引用的部分保留到发送完成，之后的读取使用剩余部分，剩余不足时换一块
+  */
+static void alloc_buffer(uv_handle_t *handle, size_t size, uv_buf_t *buf) {
+	uni_shard *shard = shard_of(handle);
+	uni_pool *pool = &shard->pool;
+
+	pool->reads += 1;
+	if(shard->recv) {
+		if(pool_refs(shard->recv) == 1) {
+			shard->recv_used = 0;
+		}
+		else if((DEFAULT_SCRATCH_SIZE - shard->recv_used) < DEFAULT_RECV_MIN) {
+			pool_free(pool, shard->recv);
+			shard->recv = (char *)0;
+		}
+	}
+	if(!shard->recv) {
+		shard->recv = pool_alloc(pool, DEFAULT_SCRATCH_SIZE);
+		shard->recv_used = 0;
+	}
+
+	buf->base = shard->recv ? (shard->recv + shard->recv_used) : (char *)0;
+	buf->len = shard->recv ? (DEFAULT_SCRATCH_SIZE - shard->recv_used) : 0;
+}
+
+
+
+/**
+  * @brief  连接已关闭，没有其它线程引用时归还内存池
+  */
+static void on_after_close(uv_handle_t *handle) {
+	uni_client *client = (uni_client *)handle;
+
+	client->closed = 1;
+	if(!client->refs) {
+		slab_free(&shard_of(client)->slab, client);
+	}
+}
+
+/**
+  * @brief  释放工作线程对客户端的引用，连接已关闭时归还内存池
+  */
+static void client_release(uni_client *client) {
+	client->refs -= 1;
+	if(!client->refs && client->closed) {
+		slab_free(&shard_of(client)->slab, client);
+	}
+}
+
+/**
+  * @brief  发送数据完成
+  */
+static void on_after_write(uv_write_t *req, int status) {
+	if (status) {
+		fprintf(stderr, "Write error %s\n", uv_strerror(status));
+	}
+
+	pool_free(&shard_of(req->handle)->pool, ((uni_write *)req)->buf.base);
+	free(req);
+}
+
+/**
+  * @brief  上行管道待发送的字节数
+  */
+static size_t flow_queued(uni_shard *shard) {
+	if(!shard->runs.connection) {
+		return 0;
+	}
+
+	return uv_stream_get_write_queue_size(shard->runs.connection->handle) + shard->outq.size;
+}
+
+/**
+  * @brief  暂停读取客户端数据
+  */
+static void flow_pause(uni_shard *shard, uni_client *client) {
+	uni_flow *flow = &shard->flow;
+
+	if(client->paused || uv_read_stop((uv_stream_t *)client)) {
+		return;
+	}
+	client->paused = 1;
+	client->paused_at = uv_now(shard->loop);
+	client->pause_prev = (uni_client *)0;
+	client->pause_next = flow->paused;
+	if(flow->paused) {
+		flow->paused->pause_prev = client;
+	}
+	flow->paused = client;
+	flow->count += 1;
+	flow->pauses += 1;
+}
+
+/**
+  * @brief  从暂停列表中移除，累计暂停时间
+  */
+static void flow_unlink(uni_shard *shard, uni_client *client) {
+	uni_flow *flow = &shard->flow;
+
+	if(!client->paused) {
+		return;
+	}
+	if(client->pause_prev) {
+		client->pause_prev->pause_next = client->pause_next;
+	}
+	else {
+		flow->paused = client->pause_next;
+	}
+	if(client->pause_next) {
+		client->pause_next->pause_prev = client->pause_prev;
+	}
+	client->paused = 0;
+	client->pause_next = (uni_client *)0;
+	client->pause_prev = (uni_client *)0;
+	flow->count -= 1;
+	flow->paused_ms += uv_now(shard->loop) - client->paused_at;
+}
+
+/**
+  * @brief  开始新的统计周期，由时间轮每秒调用
+  */
+static void flow_window(uni_shard *shard) {
+	uni_flow *flow = &shard->flow;
+
+	flow->average = flow->window_bytes / (shard->table.size ? shard->table.size : 1);
+	flow->window_bytes = 0;
+	flow->window += 1;
+}
+
+/**
+  * @brief  心跳只更新内存中的时间戳，客户端加入待写入列表，由定时器批量写入数据库
+  */
+static void seen_touch(uni_shard *shard, uni_client *client) {
+	uni_seen *seen = &shard->seen;
+
+	seen->heartbeats += 1;
+	if(client->dirty || !client->name[0] || !configs.database[0]) {
+		return;
+	}
+	client->dirty = 1;
+	client->dirty_prev = (uni_client *)0;
+	client->dirty_next = seen->dirty;
+	if(seen->dirty) {
+		seen->dirty->dirty_prev = client;
+	}
+	seen->dirty = client;
+	seen->count += 1;
+}
+
+/**
+  * @brief  从待写入列表中移除
+  */
+static void seen_unlink(uni_shard *shard, uni_client *client) {
+	uni_seen *seen = &shard->seen;
+
+	if(!client->dirty) {
+		return;
+	}
+	if(client->dirty_prev) {
+		client->dirty_prev->dirty_next = client->dirty_next;
+	}
+	else {
+		seen->dirty = client->dirty_next;
+	}
+	if(client->dirty_next) {
+		client->dirty_next->dirty_prev = client->dirty_prev;
+	}
+	client->dirty = 0;
+	client->dirty_next = (uni_client *)0;
+	client->dirty_prev = (uni_client *)0;
+	seen->count -= 1;
+}
+
+/**
+  * @brief  待写入列表中的最后在线时间一次写入数据库，每个客户端只写最新的时间戳
+  */
+static void seen_flush(uni_shard *shard) {
+	uni_seen *seen = &shard->seen;
+	unsigned int count = 0;
+
+	if(!seen->count) {
+		return;
+	}
+
+	db_seen *rows = (db_seen *)malloc(seen->count * sizeof(db_seen));
+	if(!rows) {
+		//保留待写入列表，下个周期重试
+		fprintf(stderr, "No memory for heartbeat rows\n");
+		return;
+	}
+	while(seen->dirty) {
+		uni_client *client = seen->dirty;
+		memcpy(rows[count].name, client->name, sizeof(rows[count].name));
+		rows[count].seen = (int64_t)client->timestamp;
+		count += 1;
+		seen_unlink(shard, client);
+	}
+	db_heartbeat(rows, count);
+	seen->flushed += count;
+	free(rows);
+}
+
+/**
+  * @brief  最后在线时间写入定时器回调
+  */
+static void on_seen(uv_timer_t *handle) {
+	seen_flush(shard_of(handle));
+}
+
+/**
+  * @brief  关闭客户端，从在线表中移除，关闭完成后回收
+  */
+static void client_close(uni_client *client) {
+	uni_shard *shard = shard_of(client);
+
+	if(uv_is_closing((uv_handle_t *)client)) {
+		return;
+	}
+
+	table_remove(&shard->table, client);
+	if(client->name[0]) {
+		packet_meta meta;
+		memset(&meta, 0, sizeof(meta));
+		meta.seen = (int64_t)client->timestamp;
+		memcpy(meta.ip, client->ip, sizeof(meta.ip));
+		meta.port = client->port;
+		route_unbind(shard, client->name, client->hash, client->serial, &meta);
+		//数据库与离线缓存使用同一最后在线时间，缓存项被淘汰前后查询结果一致
+		db_disconnect(client->name, client->ip, client->port, meta.seen);
+	}
+	//名称句柄没有引用后可复用
+	intern_release(client->id);
+	client->id = 0;
+	wheel_remove(client);
+	flow_unlink(shard, client);
+	//断开事件同时以 timestamp 更新最后在线时间
+	seen_unlink(shard, client);
+	pool_free(&shard->pool, client->pending);
+	client->pending = (char *)0;
+	client->pending_size = 0;
+	client->pending_capacity = 0;
+	uv_close((uv_handle_t *)client, on_after_close);
+}
+
+/**
+  * @brief  时间轮定时器回调，每秒推进一格
+  *         心跳只更新 timestamp，到期时按最新 timestamp 重新计算，未超时的重新加入时间轮
+  */
+static void on_wheel(uv_timer_t *handle) {
+	uni_wheel *wheel = &shard_of(handle)->wheel;
+	time_t now = time(NULL);
+
+	//流量统计周期
+	flow_window(shard_of(handle));
+
+	//时钟大幅跳变时只推进一整圈
+	if((now - wheel->tick) > ((time_t)WHEEL_SIZE * WHEEL_SIZE)) {
+		wheel->tick = now - (time_t)WHEEL_SIZE * WHEEL_SIZE;
+	}
+
+	while(wheel->tick < now) {
+		uni_client *list;
+
+		wheel->tick += 1;
+		//第二级到期的一格下放到第一级
+		if(!(wheel->tick & WHEEL_MASK)) {
+			list = wheel_take(&wheel->slots[1][(wheel->tick >> WHEEL_BITS) & WHEEL_MASK]);
+			while(list) {
+				uni_client *client = list;
+				list = list->wheel_next;
+				wheel_insert(wheel, client, client->expire);
+			}
+		}
+
+		list = wheel_take(&wheel->slots[0][wheel->tick & WHEEL_MASK]);
+		while(list) {
+			uni_client *client = list;
+			//恢复读取后重新计时，不改写最后在线时间
+			time_t expire = ((client->resumed > client->timestamp) ? client->resumed : client->timestamp) + configs.timeout;
+			list = list->wheel_next;
+			if(expire > wheel->tick) {
+				wheel_insert(wheel, client, expire);
+			}
+			else if(client->paused) {
+				//暂停读取的客户端恢复时重新计时
+				wheel_insert(wheel, client, wheel->tick + configs.timeout);
+			}
+			else {
+				//该客户端已经超时，关闭并回收
+				wheel->expired += 1;
+				db_event(DB_ERROR, client->name, client->ip, client->port, "timeout");
+				client_close(client);
+			}
+		}
+	}
+}
+
+
+
+/**
+  * @brief  按上行管道待发送的字节数切换拥塞状态，低于低水位时恢复所有暂停的客户端
+  */
+static void flow_check(uni_shard *shard) {
+	uni_flow *flow = &shard->flow;
+	size_t queued = flow_queued(shard);
+
+	if(!flow->congested) {
+		if(queued >= configs.high_watermark) {
+			flow->congested = 1;
+			flow->since = uv_now(shard->loop);
+			flow->congestions += 1;
+		}
+		return;
+	}
+	if(queued > configs.low_watermark) {
+		return;
+	}
+
+	flow->congested = 0;
+	flow->congested_ms += uv_now(shard->loop) - flow->since;
+	while(flow->paused) {
+		uni_client *client = flow->paused;
+		flow_unlink(shard, client);
+		//暂停期间未读取的心跳不计入超时
+		client->resumed = time(NULL);
+		if(uv_read_start((uv_stream_t *)client, alloc_buffer, on_read)) {
+			client_close(client);
+		}
+	}
+}
+
+/**
+  * @brief  拥塞时暂停流量大的客户端：本统计周期读取量不低于上一周期的平均值，
+  *         待发送字节数超过高水位两倍时暂停所有仍在发送的客户端
+  */
+static void flow_account(uni_shard *shard, uni_client *client, size_t size) {
+	uni_flow *flow = &shard->flow;
+
+	if(client->window != flow->window) {
+		client->window = flow->window;
+		client->bytes = 0;
+	}
+	client->bytes += size;
+	flow->window_bytes += size;
+
+	if(!flow->congested || uv_is_closing((uv_handle_t *)client)) {
+		return;
+	}
+	if((client->bytes >= flow->average) || (flow_queued(shard) >= (configs.high_watermark << 1))) {
+		flow_pause(shard, client);
+	}
+}
+
+/**
+  * @brief  重新连接上行管道
+  */
+static void on_pipe_retry(uv_timer_t *handle) {
+	uni_shard *shard = shard_of(handle);
+	int rc;
+
+	if(rc = uv_pipe_init(shard->loop, &shard->pipe, 0)) {
+		fprintf(stderr, "uv_pipe_init failed %s\n", uv_strerror(rc));
+		uv_timer_start(handle, on_pipe_retry, PIPE_RETRY_MAX, 0);
+		return;
+	}
+	uv_pipe_connect(&shard->connect, &shard->pipe, (const char *)configs.sock, on_pipe_connect);
+}
+
+/**
+  * @brief  上行管道已关闭，按指数退避等待后重新连接
+  */
+static void on_pipe_closed(uv_handle_t *handle) {
+	uni_runs *runs = &shard_of(handle)->runs;
+	uint64_t delay = PIPE_RETRY_MIN;
+
+	//被取消的写请求均已放回暂存队列
+	shard_of(handle)->store.requeued = (uni_record *)0;
+	//退出时不再重新连接
+	if(shard_of(handle)->stopping) {
+		return;
+	}
+	for(unsigned int n=0; (n<runs->attempts) && (delay<PIPE_RETRY_MAX); n++) {
+		delay <<= 1;
+	}
+	if(delay > PIPE_RETRY_MAX) {
+		delay = PIPE_RETRY_MAX;
+	}
+	runs->attempts += 1;
+	uv_timer_start(&runs->retry, on_pipe_retry, delay, 0);
+}
+
+/**
+  * @brief  上行管道断开或连接失败，关闭后重新连接，期间上送的报文进入暂存队列
+  *         上行队列中尚未交给 uv_write 的报文放回暂存队列，已交给 uv_write 的报文随管道关闭丢弃
+  */
+static void pipe_lost(uni_shard *shard) {
+	if(uv_is_closing((uv_handle_t *)&shard->pipe)) {
+		return;
+	}
+
+	shard->runs.connection = (uv_connect_t *)0;
+	//上行队列晚于未完成的写请求，写请求被取消时放在它之前
+	store_requeue(shard, shard->outq.sources, shard->outq.sourced, 0);
+	shard->store.requeued = (uni_record *)0;
+	outq_clear(shard);
+	pool_free(&shard->pool, shard->inq.data);
+	shard->inq.data = (char *)0;
+	shard->inq.size = 0;
+	shard->inq.capacity = 0;
+	uv_close((uv_handle_t *)&shard->pipe, on_pipe_closed);
+	//上行不可用时不再暂停读取，报文进入暂存队列
+	flow_check(shard);
+}
+
+/**
+  * @brief  释放上行队列引用的内存块
+  */
+static void outq_release(uni_pool *pool, char **holds, unsigned int count) {
+	for(unsigned int n=0; n<count; n++) {
+		pool_free(pool, holds[n]);
+	}
+}
+
+/**
+  * @brief  管道写数据完成，释放该批引用的内存块和包头
+  */
+static void pipe_after_write(uv_write_t *req, int status) {
+	uni_shard *shard = shard_of(req->handle);
+	uni_batch *batch = (uni_batch *)req;
+
+	if (status && (status != UV_ECANCELED)) {
+		fprintf(stderr, "Write error %s\n", uv_strerror(status));
+		pipe_lost(shard);
+	}
+	//出错或管道关闭时该批报文放回暂存队列 (已部分写入的可能重复发送)，之后释放引用
+	if(status) {
+		store_requeue(shard, batch->sources, batch->sourced, batch->from);
+	}
+
+	outq_release(&shard->pool, batch->holds, batch->count);
+	free(batch->holds);
+	free(batch->sources);
+	//写请求按顺序完成，该批之前的包头均可复用，没有未完成的写请求且队列为空时全部可复用
+	shard->outq.writing -= 1;
+	shard->outq.head = (!shard->outq.writing && !shard->outq.count) ? shard->outq.tail : batch->tail;
+	free(batch);
+	flow_check(shard);
+}
+
+/**
+  * @brief  上行发送队列扩容，保证之后追加 bufs 个数据块和 holds 个引用不会失败
+  */
+static int outq_reserve(uni_outq *outq, unsigned int bufs, unsigned int holds) {
+	if(outq->sourced >= outq->source_capacity) {
+		unsigned int capacity = outq->source_capacity ? (outq->source_capacity << 1) : DEFAULT_OUTQ_SIZE;
+		uni_frame *data = (uni_frame *)realloc(outq->sources, capacity * sizeof(uni_frame));
+		if(!data) {
+			return -1;
+		}
+		outq->sources = data;
+		outq->source_capacity = capacity;
+	}
+	if((outq->count + bufs) > outq->capacity) {
+		unsigned int capacity = outq->capacity ? (outq->capacity << 1) : DEFAULT_OUTQ_SIZE;
+		uv_buf_t *data = (uv_buf_t *)realloc(outq->bufs, capacity * sizeof(uv_buf_t));
+		if(!data) {
+			return -1;
+		}
+		outq->bufs = data;
+		outq->capacity = capacity;
+	}
+	if((outq->held + holds) > outq->hold_capacity) {
+		unsigned int capacity = outq->hold_capacity ? (outq->hold_capacity << 1) : DEFAULT_OUTQ_SIZE;
+		char **data = (char **)realloc(outq->holds, capacity * sizeof(char *));
+		if(!data) {
+			return -1;
+		}
+		outq->holds = data;
+		outq->hold_capacity = capacity;
+	}
+
+	return 0;
+}
+
+/**
+  * @brief  上行队列追加一个数据块
+  */
+static void outq_push(uni_outq *outq, char *data, size_t size) {
+	outq->bufs[outq->count] = uv_buf_init(data, (unsigned int)size);
+	outq->count += 1;
+	outq->size += size;
+}
+
+/**
+  * @brief  从环形缓冲区取一个前缀和包头，被未完成的写请求占满时从内存池分配
+  */
+static uni_head *outq_header(uni_shard *shard) {
+	uni_outq *outq = &shard->outq;
+	char *block;
+
+	if((outq->tail - outq->head) < DEFAULT_RING_SIZE) {
+		return &outq->ring[(outq->tail++) % DEFAULT_RING_SIZE];
+	}
+
+	block = pool_alloc(&shard->pool, sizeof(uni_head));
+	if(block) {
+		outq->holds[outq->held++] = block;
+	}
+
+	return (uni_head *)block;
+}
+
+/**
+  * @brief  清空上行队列，释放引用的内存块，没有未完成的写请求时包头全部可复用
+  */
+static void outq_clear(uni_shard *shard) {
+	uni_outq *outq = &shard->outq;
+
+	outq_release(&shard->pool, outq->holds, outq->held);
+	outq->held = 0;
+	outq->count = 0;
+	outq->size = 0;
+	outq->sourced = 0;
+	if(!outq->writing) {
+		outq->head = outq->tail;
+	}
+}
+
+/**
+  * @brief  发送上行队列，先直接写入，管道忙时剩余部分交给 uv_write，引用的内存块保留到发送完成
+  *         包头只在写请求完成后复用；写入一部分后出错时字节流停在包中间，关闭管道重新连接
+  */
+static void pipe_flush(uni_shard *shard) {
+	uni_outq *outq = &shard->outq;
+	uni_batch *batch;
+	unsigned int n = 0;
+	int rc;
+
+	if(!outq->count) {
+		return;
+	}
+	if(!shard->runs.connection) {
+		outq_clear(shard);
+		return;
+	}
+	//先分配写请求，直接写入一部分后不会因内存不足而中断
+	batch = (uni_batch *)malloc(sizeof(*batch));
+	if(!batch) {
+		//放回暂存队列稍后重发
+		fprintf(stderr, "No memory for upstream queue\n");
+		store_requeue(shard, outq->sources, outq->sourced, 0);
+		shard->store.requeued = (uni_record *)0;
+		outq_clear(shard);
+		store_replay(shard);
+		return;
+	}
+
+	outq->batches += 1;
+	rc = uv_try_write(shard->runs.connection->handle, outq->bufs, outq->count);
+	if(rc == (int)outq->size) {
+		//全部写入时没有未完成的写请求 (否则 uv_try_write 返回 UV_EAGAIN)
+		outq->direct += 1;
+		free(batch);
+		outq_clear(shard);
+		return;
+	}
+	if((rc < 0) && (rc != UV_EAGAIN) && (rc != UV_ENOSYS)) {
+		fprintf(stderr, "uv_try_write failed: %s\n", uv_strerror(rc));
+		free(batch);
+		pipe_lost(shard);
+		return;
+	}
+	if(rc < 0) {
+		rc = 0;
+	}
+
+	//跳过已写入的部分
+	while((size_t)rc >= outq->bufs[n].len) {
+		rc -= outq->bufs[n].len;
+		n += 1;
+	}
+	outq->bufs[n].base += rc;
+	outq->bufs[n].len -= rc;
+
+	//引用和报文来源转交给写请求
+	batch->holds = outq->holds;
+	batch->count = outq->held;
+	batch->tail = outq->tail;
+	batch->sources = outq->sources;
+	batch->sourced = outq->sourced;
+	batch->from = n;
+	outq->holds = (char **)0;
+	outq->held = 0;
+	outq->hold_capacity = 0;
+	outq->sources = (uni_frame *)0;
+	outq->sourced = 0;
+	outq->source_capacity = 0;
+	outq->queued += 1;
+	rc = uv_write((uv_write_t *)batch, shard->runs.connection->handle, outq->bufs + n, outq->count - n, pipe_after_write);
+	if(rc) {
+		fprintf(stderr, "uv_write failed: %s\n", uv_strerror(rc));
+		//未完整写入的报文放回暂存队列，之后释放引用
+		store_requeue(shard, batch->sources, batch->sourced, n);
+		shard->store.requeued = (uni_record *)0;
+	}
+	outq->count = 0;
+	outq->size = 0;
+	if(rc) {
+		outq_release(&shard->pool, batch->holds, batch->count);
+		free(batch->holds);
+		free(batch->sources);
+		free(batch);
+		if(!outq->writing) {
+			outq->head = outq->tail;
+		}
+		pipe_lost(shard);
+		return;
+	}
+	outq->writing += 1;
+}
+
+/**
+  * @brief  每轮事件处理完成后合并发送本轮产生的上行数据
+  */
+static void on_flush(uv_check_t *handle) {
+	store_flush(shard_of(handle));
+	pipe_flush(shard_of(handle));
+	flow_check(shard_of(handle));
+	uv_check_stop(handle);
+}
+
+/**
+  * @brief  本连接上是否已发送过句柄当前对应的名称，未发送时记录为已发送
+  *         按表项的 generation 记录，句柄被其它名称复用后重新附带名称；调用者须持有句柄的引用
+  */
+static int pipe_defined(uni_shard *shard, uint32_t id) {
+	uni_runs *runs = &shard->runs;
+	uint32_t generation = intern_name(id)->generation;
+
+	if(id >= runs->defined_size) {
+		uint32_t size = runs->defined_size ? runs->defined_size : DEFAULT_TABLE_SIZE;
+		while(id >= size) {
+			size <<= 1;
+		}
+		uint32_t *defined = (uint32_t *)realloc(runs->defined, size * sizeof(uint32_t));
+		if(!defined) {
+			//无法记录时每次都附带名称
+			return 0;
+		}
+		memset(defined + runs->defined_size, 0, (size - runs->defined_size) * sizeof(uint32_t));
+		runs->defined = defined;
+		runs->defined_size = size;
+	}
+	if(runs->defined[id] == generation) {
+		return 1;
+	}
+	runs->defined[id] = generation;
+
+	return 0;
+}
+
+/**
+  * @brief  管道写报文，包头取自环形缓冲区，报文位于内存块 block 中时只增加引用，否则拷贝
+  *         放入上行队列，本轮事件处理完成后统一发送
+  *         id 为名称句柄 (0 表示没有)，对端支持时以句柄代替名称
+  */
+static void pipe_emit(uni_shard *shard, uint32_t id, const char *name, enum __flags flag, char *block, const char *buffer, int size) {
+	uni_outq *outq = &shard->outq;
+	uni_head *head;
+	size_t length;
+	if(!shard->runs.connection) {
+		return;
+	}
+
+	if(outq_reserve(outq, 2, 2)) {
+		fprintf(stderr, "No memory for upstream queue\n");
+		return;
+	}
+
+	//前缀和包头
+	head = outq_header(shard);
+	if(!head) {
+		fprintf(stderr, "No memory for upstream queue\n");
+		return;
+	}
+	outq->seq += 1;
+	if(shard->runs.version == PACKET_VERSION_2) {
+		packet_v2 packet;
+		packet.seq = outq->seq;
+		packet.timestamp = shard->stamp ? shard->stamp : clock_now();
+		packet.flag = (uint8_t)flag;
+		packet.options = 0;
+		packet.handle = id ? PACKET_HANDLE_MAKE(id, intern_name(id)->generation) : 0;
+		packet.name = name;
+		packet.name_size = 0;
+		packet.size = size;
+		if(id && shard->runs.handles) {
+			packet.options = PACKET_HANDLE;
+			if(!pipe_defined(shard, id)) {
+				packet.options |= PACKET_DEFINE;
+				packet.name_size = strlen(name);
+			}
+		}
+		else {
+			packet.name_size = strlen(name);
+		}
+		length = packet_v2_encode(head->data, &packet);
+	}
+	else {
+		packet_prefix prefix;
+		packet_header header;
+		memset(&header, 0, sizeof(header));
+		header.id = time(NULL);
+		strcpy(header.name, name);
+		header.flag = (uint8_t)flag;
+		prefix.magic = PACKET_MAGIC;
+		prefix.version = PACKET_VERSION;
+		prefix.reserved = 0;
+		prefix.length = (uint32_t)(sizeof(header) + size);
+		memcpy(head->data, &prefix, sizeof(prefix));
+		memcpy(head->data + sizeof(prefix), &header, sizeof(header));
+		length = sizeof(prefix) + sizeof(header);
+	}
+	//报文
+	if(size > 0) {
+		if(block) {
+			pool_ref(block);
+		}
+		else {
+			block = pool_alloc(&shard->pool, size);
+			if(!block) {
+				//已取的包头随本批发送完成后复用
+				fprintf(stderr, "No memory for upstream queue\n");
+				return;
+			}
+			memcpy(block, buffer, size);
+			buffer = block;
+			outq->copied += 1;
+		}
+		outq->holds[outq->held++] = block;
+	}
+	//上送的报文记录来源，管道断开时放回暂存队列
+	if(flag == PH_TRANSMIT) {
+		uni_frame *frame = &outq->sources[outq->sourced++];
+		frame->stamp = shard->stamp ? shard->stamp : clock_now();
+		frame->size = (uint32_t)size;
+		frame->buf = outq->count;
+		frame->flag = (uint8_t)flag;
+		frame->data = buffer;
+		strcpy(frame->name, name);
+	}
+	outq_push(outq, head->data, length);
+	if(size > 0) {
+		outq_push(outq, (char *)buffer, size);
+	}
+	outq->frames += 1;
+	uv_check_start(&outq->check, on_flush);
+}
+
+/**
+  * @brief  暂存队列中是否有未发送的报文
+  */
+static int store_pending(uni_store *store) {
+	return (store->head || store->spilled) ? 1 : 0;
+}
+
+/**
+  * @brief  暂存文件已全部发送，关闭并删除
+  */
+static void store_reset(uni_store *store) {
+	if(store->reader) {
+		fclose(store->reader);
+		store->reader = (FILE *)0;
+	}
+	if(store->writer) {
+		fclose(store->writer);
+		store->writer = (FILE *)0;
+	}
+	store->spilled = 0;
+	store->batched = 0;
+	store->batch_count = 0;
+	remove(store->path);
+}
+
+/**
+  * @brief  打开暂存文件，读写分别使用各自的文件流
+  */
+static int store_file(uni_store *store) {
+	store->writer = fopen(store->path, "ab");
+	if(!store->writer) {
+		return -1;
+	}
+	//报文先拼接到 batch，每批一次写入，失败时可截断到写入前的位置
+	setvbuf(store->writer, (char *)0, _IONBF, 0);
+	store->reader = fopen(store->path, "rb");
+	if(!store->reader) {
+		fclose(store->writer);
+		store->writer = (FILE *)0;
+		return -1;
+	}
+	//重发时按块读取，不必每条报文读一次文件
+	setvbuf(store->reader, (char *)0, _IOFBF, STORE_BATCH_SIZE);
+
+	return 0;
+}
+
+/**
+  * @brief  count 条完整的报文一次写入暂存文件，失败时截断到写入前的位置并丢弃这些报文，否则之后的报文无法解析
+  */
+static void store_write(uni_shard *shard, const char *data, size_t size, unsigned int count) {
+	uni_store *store = &shard->store;
+	long position = ftell(store->writer);
+
+	if(fwrite(data, size, 1, store->writer) == 1) {
+		return;
+	}
+	fprintf(stderr, "Write spool file %s failed: %s\n", store->path, strerror(errno));
+	clearerr(store->writer);
+	if(position >= 0) {
+#if defined(WIN32)
+		_chsize(_fileno(store->writer), position);
+#else
+		if(ftruncate(fileno(store->writer), position)) {
+			fprintf(stderr, "Truncate spool file %s failed: %s\n", store->path, strerror(errno));
+		}
+#endif
+	}
+	store->spilled -= size;
+	store->stored -= count;
+	store->spooled -= count;
+	store->dropped += count;
+}
+
+/**
+  * @brief  上行不可用或暂存队列未发送完时暂存报文，保持顺序
+  *         先放在内存中，超过内存上限后追加到暂存文件，暂存文件达到上限时丢弃新报文
+  */
+static void store_append(uni_shard *shard, const char *name, enum __flags flag, const char *buffer, int size) {
+	uni_store *store = &shard->store;
+	uint64_t stamp = shard->stamp ? shard->stamp : clock_now();
+
+	//暂存文件中有报文时新报文也只能追加到文件
+	if(!store->spilled && ((store->memory + size) <= DEFAULT_STORE_MEMORY)) {
+		uni_record *record = (uni_record *)pool_alloc(&shard->pool, sizeof(uni_record) + size);
+		if(!record) {
+			store->dropped += 1;
+			return;
+		}
+		record->next = (uni_record *)0;
+		record->stamp = stamp;
+		record->size = (uint32_t)size;
+		record->flag = (uint8_t)flag;
+		strcpy(record->name, name);
+		memcpy(record + 1, buffer, size);
+		if(store->tail) {
+			store->tail->next = record;
+		}
+		else {
+			store->head = record;
+		}
+		store->tail = record;
+		store->memory += size;
+		store->stored += 1;
+		return;
+	}
+
+	if(!configs.spool_size || ((store->spilled + sizeof(uni_spooled) + size) > configs.spool_size)) {
+		store->dropped += 1;
+		return;
+	}
+	if(!store->writer && store_file(store)) {
+		fprintf(stderr, "Open spool file %s failed: %s\n", store->path, strerror(errno));
+		store->dropped += 1;
+		return;
+	}
+
+	if(!store->batch && !(store->batch = (char *)malloc(STORE_BATCH_SIZE))) {
+		store->dropped += 1;
+		return;
+	}
+	//包头与报文拼接到 batch，放不下时先写入之前的报文，超过 batch 的报文单独写入
+	if((store->batched + sizeof(uni_spooled) + size) > STORE_BATCH_SIZE) {
+		store_flush(shard);
+	}
+	uni_spooled spooled;
+	memset(&spooled, 0, sizeof(spooled));
+	spooled.size = (uint32_t)size;
+	spooled.flag = (uint8_t)flag;
+	spooled.stamp = stamp;
+	strcpy(spooled.name, name);
+	store->spilled += sizeof(uni_spooled) + size;
+	store->stored += 1;
+	store->spooled += 1;
+	if((sizeof(uni_spooled) + size) > STORE_BATCH_SIZE) {
+		uni_spooled *record = (uni_spooled *)pool_alloc(&shard->pool, sizeof(uni_spooled) + size);
+		if(!record) {
+			store->spilled -= sizeof(uni_spooled) + size;
+			store->dropped += 1;
+			return;
+		}
+		memcpy(record, &spooled, sizeof(spooled));
+		memcpy(record + 1, buffer, size);
+		store_write(shard, (const char *)record, sizeof(uni_spooled) + size, 1);
+		pool_free(&shard->pool, (char *)record);
+		return;
+	}
+	memcpy(store->batch + store->batched, &spooled, sizeof(spooled));
+	memcpy(store->batch + store->batched + sizeof(spooled), buffer, size);
+	store->batched += sizeof(uni_spooled) + size;
+	store->batch_count += 1;
+	//本轮事件处理完成后写入
+	uv_check_start(&shard->outq.check, on_flush);
+}
+
+/**
+  * @brief  拼接的 batch 写入暂存文件，上行队列发送和重发读取文件之前调用
+  */
+static void store_flush(uni_shard *shard) {
+	uni_store *store = &shard->store;
+
+	if(!store->batched) {
+		return;
+	}
+	store_write(shard, store->batch, store->batched, store->batch_count);
+	store->batched = 0;
+	store->batch_count = 0;
+}
+
+/**
+  * @brief  上行断开时，frames 中从第 from 个数据块起未完整写入的上送报文放回暂存队列
+  *         这些报文早于暂存队列中的所有报文，依次插在上一次放回的报文之后 (requeued 为空时插在头部)，保持原来的顺序
+  */
+static void store_requeue(uni_shard *shard, uni_frame *frames, unsigned int count, unsigned int from) {
+	uni_store *store = &shard->store;
+	uni_record *head = (uni_record *)0;
+	uni_record *tail = (uni_record *)0;
+
+	for(unsigned int n=0; n<count; n++) {
+		uni_frame *frame = &frames[n];
+		//包头与报文均已写入
+		if((frame->buf + (frame->size ? 1 : 0)) < from) {
+			continue;
+		}
+		uni_record *record = (uni_record *)pool_alloc(&shard->pool, sizeof(uni_record) + frame->size);
+		if(!record) {
+			store->dropped += 1;
+			continue;
+		}
+		record->next = (uni_record *)0;
+		record->stamp = frame->stamp;
+		record->size = frame->size;
+		record->flag = frame->flag;
+		strcpy(record->name, frame->name);
+		memcpy(record + 1, frame->data, frame->size);
+		if(tail) {
+			tail->next = record;
+		}
+		else {
+			head = record;
+		}
+		tail = record;
+		store->memory += frame->size;
+		store->stored += 1;
+	}
+
+	if(head) {
+		if(store->requeued) {
+			tail->next = store->requeued->next;
+			store->requeued->next = head;
+		}
+		else {
+			tail->next = store->head;
+			store->head = head;
+		}
+		if(!tail->next) {
+			store->tail = tail;
+		}
+		store->requeued = tail;
+	}
+}
+
+/**
+  * @brief  暂存报文发送定时器，按限速从暂存队列取出报文发送，上行拥塞时等待
+  */
+static void on_replay(uv_timer_t *handle) {
+	uni_shard *shard = shard_of(handle);
+	uni_store *store = &shard->store;
+	size_t budget = configs.replay_rate / (1000 / STORE_INTERVAL);
+	size_t watermark = configs.low_watermark;
+
+	if(!shard->runs.connection) {
+		uv_timer_stop(handle);
+		return;
+	}
+	//重新连接后内存中暂存的报文不限速，合并为一批发送
+	if(store->burst) {
+		budget += store->memory;
+		watermark = configs.high_watermark;
+		store->burst = 0;
+	}
+	//读取文件前写入拼接的报文
+	store_flush(shard);
+
+	while(store_pending(store) && budget && (flow_queued(shard) < watermark)) {
+		if(store->head) {
+			//内存中的报文直接引用发送
+			uni_record *record = store->head;
+			store->head = record->next;
+			if(!store->head) {
+				store->tail = (uni_record *)0;
+			}
+			store->memory -= record->size;
+			shard->stamp = record->stamp;
+			pipe_emit(shard, 0, record->name, (enum __flags)record->flag, (char *)record, (const char *)(record + 1), record->size);
+			budget -= (record->size < budget) ? record->size : budget;
+			pool_free(&shard->pool, (char *)record);
+		}
+		else {
+			uni_spooled spooled;
+			char *data = (char *)0;
+			if((fread(&spooled, sizeof(spooled), 1, store->reader) != 1) || (spooled.size > PACKET_MAX_SIZE) || \
+			(spooled.size && (!(data = pool_alloc(&shard->pool, spooled.size)) || (fread(data, spooled.size, 1, store->reader) != 1)))) {
+				//文件不完整，丢弃剩余部分
+				fprintf(stderr, "Spool file %s truncated\n", store->path);
+				pool_free(&shard->pool, data);
+				store_reset(store);
+				break;
+			}
+			spooled.name[sizeof(spooled.name) - 1] = 0;
+			shard->stamp = spooled.stamp;
+			pipe_emit(shard, 0, spooled.name, (enum __flags)spooled.flag, data, data, spooled.size);
+			pool_free(&shard->pool, data);
+			budget -= (spooled.size < budget) ? spooled.size : budget;
+			store->spilled -= sizeof(spooled) + spooled.size;
+			if(!store->spilled) {
+				store_reset(store);
+			}
+		}
+		shard->stamp = 0;
+		store->replayed += 1;
+	}
+
+	if(!store_pending(store)) {
+		uv_timer_stop(handle);
+	}
+}
+
+/**
+  * @brief  开始发送暂存的报文
+  */
+static void store_replay(uni_shard *shard) {
+	if(store_pending(&shard->store) && shard->runs.connection) {
+		uv_timer_start(&shard->store.timer, on_replay, 0, STORE_INTERVAL);
+	}
+}
+
+/**
+  * @brief  打开暂存队列，上次未发送完的暂存文件在上行连接后继续发送
+  */
+static int store_open(uni_shard *shard) {
+	uni_store *store = &shard->store;
+	FILE *fp;
+	int rc;
+
+	if(rc = uv_timer_init(shard->loop, &store->timer)) {
+		fprintf(stderr, "uv_timer_init failed: %s", uv_strerror(rc));
+		return -1;
+	}
+	snprintf(store->path, sizeof(store->path), "%s.%u", configs.spool, shard->index);
+	if((fp = fopen(store->path, "rb"))) {
+		fseek(fp, 0, SEEK_END);
+		long size = ftell(fp);
+		fclose(fp);
+		if(size > 0) {
+			if(store_file(store)) {
+				fprintf(stderr, "Open spool file %s failed: %s\n", store->path, strerror(errno));
+				return -1;
+			}
+			store->spilled = (uint64_t)size;
+		}
+		else {
+			remove(store->path);
+		}
+	}
+
+	return 0;
+}
+
+/**
+  * @brief  暂存文件 from 追加到暂存文件 to 之后删除，失败时 to 截断到追加前的长度，from 保留
+  */
+static int store_merge(const char *from, const char *to) {
+	FILE *reader = fopen(from, "rb");
+	FILE *writer = (FILE *)0;
+	char buffer[4096];
+	long position = -1;
+	size_t n;
+	int rc = -1;
+
+	if(reader && (writer = fopen(to, "ab"))) {
+		fseek(writer, 0, SEEK_END);
+		position = ftell(writer);
+		while((n = fread(buffer, 1, sizeof(buffer), reader)) > 0) {
+			if(fwrite(buffer, 1, n, writer) != n) {
+				break;
+			}
+		}
+		if(!ferror(reader) && feof(reader) && !fflush(writer)) {
+			rc = 0;
+		}
+	}
+	if(rc) {
+		fprintf(stderr, "Merge spool file %s into %s failed: %s\n", from, to, strerror(errno));
+		if(writer && (position >= 0)) {
+			fflush(writer);
+			clearerr(writer);
+#if defined(WIN32)
+			_chsize(_fileno(writer), position);
+#else
+			if(ftruncate(fileno(writer), position)) {
+				fprintf(stderr, "Truncate spool file %s failed: %s\n", to, strerror(errno));
+			}
+#endif
+		}
+	}
+	if(reader) {
+		fclose(reader);
+	}
+	if(writer) {
+		fclose(writer);
+	}
+	if(!rc) {
+		remove(from);
+	}
+
+	return rc;
+}
+
+/**
+  * @brief  事件轮询数量减少后，编号不小于 loops 的暂存文件追加到编号 n % loops 的暂存文件，随该事件轮询发送
+  *         在打开暂存队列之前调用，各文件内部的报文顺序不变
+  */
+static void store_collect(void) {
+	char dir[sizeof(configs.spool)];
+	char from[sizeof(configs.spool) + 16];
+	char to[sizeof(configs.spool) + 16];
+	const char *base = strrchr(configs.spool, '/');
+	uv_dirent_t entry;
+	uv_fs_t req;
+	size_t length;
+	int rc;
+
+#if defined(WIN32)
+	if(!base) {
+		base = strrchr(configs.spool, '\\');
+	}
+#endif
+	if(base) {
+		snprintf(dir, sizeof(dir), "%.*s", (int)(base - configs.spool), configs.spool);
+		base += 1;
+	}
+	else {
+		strcpy(dir, ".");
+		base = configs.spool;
+	}
+	length = strlen(base);
+
+	if((rc = uv_fs_scandir(uv_default_loop(), &req, dir[0] ? dir : "/", 0, (uv_fs_cb)0)) < 0) {
+		fprintf(stderr, "Scan spool directory %s failed: %s\n", dir, uv_strerror(rc));
+		uv_fs_req_cleanup(&req);
+		return;
+	}
+	while(uv_fs_scandir_next(&req, &entry) != UV_EOF) {
+		const char *digits = entry.name + length + 1;
+		unsigned long index;
+		char *end;
+
+		if(strncmp(entry.name, base, length) || (entry.name[length] != '.') || (*digits < '0') || (*digits > '9')) {
+			continue;
+		}
+		//跳过当前使用的暂存文件与未完成重写的 .tmp 文件
+		index = strtoul(digits, &end, 10);
+		if(*end || (index < configs.loops)) {
+			continue;
+		}
+		snprintf(from, sizeof(from), "%s.%lu", configs.spool, index);
+		snprintf(to, sizeof(to), "%s.%lu", configs.spool, index % configs.loops);
+		store_merge(from, to);
+	}
+	uv_fs_req_cleanup(&req);
+}
+
+/**
+  * @brief  释放暂存队列，未发送的报文 (内存中的在前，文件中未读的在后) 重写到暂存文件，下次启动时发送
+  */
+static void store_close(uni_shard *shard) {
+	uni_store *store = &shard->store;
+	char path[sizeof(store->path) + 4];
+	FILE *fp = (FILE *)0;
+
+	snprintf(path, sizeof(path), "%s.tmp", store->path);
+	if(configs.spool_size && store_pending(store)) {
+		fp = fopen(path, "wb");
+	}
+
+	while(store->head) {
+		uni_record *record = store->head;
+		store->head = record->next;
+		if(fp) {
+			uni_spooled spooled;
+			memset(&spooled, 0, sizeof(spooled));
+			spooled.size = record->size;
+			spooled.flag = record->flag;
+			spooled.stamp = record->stamp;
+			strcpy(spooled.name, record->name);
+			fwrite(&spooled, sizeof(spooled), 1, fp);
+			fwrite(record + 1, record->size, 1, fp);
+		}
+		pool_free(&shard->pool, (char *)record);
+	}
+	store->tail = (uni_record *)0;
+
+	if(fp && store->spilled) {
+		char buffer[4096];
+		size_t n;
+		store_flush(shard);
+		while((n = fread(buffer, 1, sizeof(buffer), store->reader)) > 0) {
+			fwrite(buffer, 1, n, fp);
+		}
+	}
+	if(store->reader) {
+		fclose(store->reader);
+	}
+	if(store->writer) {
+		fclose(store->writer);
+	}
+	free(store->batch);
+	store->batch = (char *)0;
+	remove(store->path);
+	if(fp) {
+		fclose(fp);
+		rename(path, store->path);
+	}
+}
+
+/**
+  * @brief  管道写报文，上送的报文在上行不可用或暂存队列未发送完时进入暂存队列
+  */
+static void pipe_write_frame(uni_shard *shard, uint32_t id, const char *name, enum __flags flag, char *block, const char *buffer, int size) {
+	if((flag == PH_TRANSMIT) && (!shard->runs.connection || store_pending(&shard->store))) {
+		store_append(shard, name, flag, buffer, size);
+		return;
+	}
+
+	pipe_emit(shard, id, name, flag, block, buffer, size);
+}
+
+/**
+  * @brief  管道写数据，数据被拷贝
+  */
+static void pipe_write_data(uni_shard *shard, const char *name, enum __flags flag, const char *buffer, int size) {
+	pipe_emit(shard, 0, name, flag, (char *)0, buffer, size);
+}
+
+/**
+  * @brief  返回带数据的下行命令结果，命令来自其它事件轮询的管道时发回该事件轮询
+  */
+static void route_reply_data(uni_shard *shard, unsigned int origin, const char *name, enum __flags flag, const char *data, unsigned int size) {
+	if(origin == shard->index) {
+		pipe_write_data(shard, name, flag, data, size);
+	}
+	else {
+		uni_message *msg = message_new(MSG_REPLY, name, 0, data, size);
+		if(msg) {
+			msg->flag = (uint8_t)flag;
+			shard_post(origin, msg);
+		}
+	}
+}
+
+/**
+  * @brief  返回下行命令结果
+  */
+static void route_reply(uni_shard *shard, unsigned int origin, const char *name, enum __flags flag) {
+	route_reply_data(shard, origin, name, flag, (const char *)0, 0);
+}
+
+/**
+  * @brief  返回不在线，数据库中有记录时附带最后状态
+  */
+static void route_reply_meta(uni_shard *shard, unsigned int origin, const uni_meta *entry) {
+	if(entry->state == META_FOUND) {
+		route_reply_data(shard, origin, entry->name, RE_OFFLINE, (const char *)&entry->data, sizeof(packet_meta));
+	}
+	else {
+		route_reply(shard, origin, entry->name, RE_OFFLINE);
+	}
+}
+
+/**
+  * @brief  在工作线程中查询数据库
+  */
+static void on_lookup(uv_work_t *req) {
+	uni_lookup *lookup = (uni_lookup *)req;
+
+	lookup->result = db_meta_read(lookup->name, &lookup->meta);
+}
+
+/**
+  * @brief  查询结果写入缓存项
+  */
+static void lookup_fill(const uni_lookup *lookup, uni_meta *entry, int status) {
+	if(entry->updated) {
+		//读取期间客户端下线，以下线时的状态为准
+		entry->state = META_FOUND;
+	}
+	else if(!status && (lookup->result > 0)) {
+		entry->state = META_FOUND;
+		entry->data.seen = lookup->meta.seen;
+		memcpy(entry->data.ip, lookup->meta.ip, sizeof(entry->data.ip));
+		entry->data.port = lookup->meta.port;
+	}
+	else {
+		entry->state = META_MISSING;
+	}
+}
+
+/**
+  * @brief  数据库查询完成，写入缓存并返回所有等待的命令
+  */
+static void on_after_lookup(uv_work_t *req, int status) {
+	uni_lookup *lookup = (uni_lookup *)req;
+	uni_shard *shard = lookup->shard;
+	uni_meta *entry = lookup->entry;
+	uni_waiter *waiters;
+
+	if(!entry) {
+		//缓存已满且均在读取，结果只返回本次命令
+		uni_meta result;
+		memset(&result, 0, sizeof(result));
+		strcpy(result.name, lookup->name);
+		lookup_fill(lookup, &result, status);
+		route_reply_meta(shard, lookup->origin, &result);
+		free(lookup);
+		return;
+	}
+
+	waiters = entry->waiters;
+	entry->waiters = (uni_waiter *)0;
+	if(entry->updated || (!status && (lookup->result >= 0))) {
+		lookup_fill(lookup, entry, status);
+	}
+	else {
+		//查询失败不缓存
+		while(waiters) {
+			uni_waiter *waiter = waiters;
+			waiters = waiters->next;
+			route_reply(shard, waiter->origin, entry->name, RE_OFFLINE);
+			free(waiter);
+		}
+		cache_unlink(&shard->cache, entry);
+		free(lookup);
+		return;
+	}
+
+	while(waiters) {
+		uni_waiter *waiter = waiters;
+		waiters = waiters->next;
+		route_reply_meta(shard, waiter->origin, entry);
+		free(waiter);
+	}
+	free(lookup);
+}
+
+/**
+  * @brief  客户端不在线，命中缓存时直接返回，未命中时在工作线程中查询数据库，同一客户端的并发查询合并为一次
+  *         下线时只更新登记所在事件轮询的缓存，其它事件轮询转交登记所在的事件轮询处理
+  */
+static void route_offline(uni_shard *shard, unsigned int origin, const char *name, uint32_t hash) {
+	uni_cache *cache = &shard->cache;
+	uni_meta *entry;
+	uni_waiter *waiter;
+	uni_lookup *lookup;
+	int rc;
+
+	if(!cache->capacity) {
+		route_reply(shard, origin, name, RE_OFFLINE);
+		return;
+	}
+	if(route_home(hash) != shard->index) {
+		uni_message *msg = message_new(MSG_OFFLINE, name, hash, (const char *)0, 0);
+		if(!msg) {
+			route_reply(shard, origin, name, RE_OFFLINE);
+			return;
+		}
+		msg->origin = (uint16_t)origin;
+		shard_post(route_home(hash), msg);
+		return;
+	}
+
+	entry = cache_find(cache, name, hash);
+	if(entry && (entry->state != META_LOADING)) {
+		cache->hits += 1;
+		route_reply_meta(shard, origin, entry);
+		return;
+	}
+
+	waiter = (uni_waiter *)malloc(sizeof(uni_waiter));
+	if(!waiter) {
+		route_reply(shard, origin, name, RE_OFFLINE);
+		return;
+	}
+	waiter->origin = origin;
+	if(entry) {
+		//已在读取，等待同一次查询的结果
+		cache->waits += 1;
+		waiter->next = entry->waiters;
+		entry->waiters = waiter;
+		return;
+	}
+
+	cache->misses += 1;
+	lookup = (uni_lookup *)malloc(sizeof(uni_lookup));
+	if(!lookup) {
+		free(waiter);
+		route_reply(shard, origin, name, RE_OFFLINE);
+		return;
+	}
+	memset(lookup, 0, sizeof(uni_lookup));
+	lookup->shard = shard;
+	lookup->origin = origin;
+	strcpy(lookup->name, name);
+
+	//缓存项均在读取时不缓存本次结果
+	entry = cache_take(cache, name, hash);
+	if(entry) {
+		entry->state = META_LOADING;
+		waiter->next = (uni_waiter *)0;
+		entry->waiters = waiter;
+		lookup->entry = entry;
+	}
+	else {
+		free(waiter);
+	}
+
+	if((rc = uv_queue_work(shard->loop, (uv_work_t *)lookup, on_lookup, on_after_lookup))) {
+		fprintf(stderr, "uv_queue_work failed: %s", uv_strerror(rc));
+		if(entry) {
+			free(entry->waiters);
+			entry->waiters = (uni_waiter *)0;
+			cache_unlink(cache, entry);
+		}
+		free(lookup);
+		route_reply(shard, origin, name, RE_OFFLINE);
+	}
+}
+
+/**
+  * @brief  在客户端所在的事件轮询执行下行命令
+  */
+static void route_command(uni_shard *shard, unsigned int origin, uint8_t flag, const char *name, const char *data, unsigned int size) {
+	int rc;
+	uni_client *dest;
+
+	//使用名称查询客户端信息
+	dest = table_find(&shard->table, name);
+	if(!dest) {
+		//返回未查询到对应客户端
+		route_offline(shard, origin, name, table_hash(name));
+		fprintf(stderr, "Client not in map\n");
+		return;
+	}
+	//判断命令
+	if(flag == (uint8_t)PH_QUERY) {
+		//返回客户端在线
+		route_reply(shard, origin, name, RE_ONLINE);
+	}
+	else if(flag == (uint8_t)PH_REJECT) {
+		//强制下线客户端
+		client_close(dest);
+		//返回已强制下线客户端
+		route_reply(shard, origin, name, RE_OK);
+	}
+	else if(flag == (uint8_t)PH_TRANSMIT) {
+		//开始发送数据到客户端
+		uni_write *wreq = (uni_write *)malloc(sizeof(uni_write));
+		if(!wreq) {
+			route_reply(shard, origin, name, RE_FAILD);
+			return;
+		}
+		wreq->buf.base = pool_alloc(&shard->pool, size);
+		if(!(wreq->buf.base)) {
+			route_reply(shard, origin, name, RE_FAILD);
+			free(wreq);
+			return;
+		}
+		wreq->buf.len = size;
+		memcpy(wreq->buf.base, data, size);
+		if(rc = uv_write((uv_write_t *)wreq, (uv_stream_t *)&dest->handle, &wreq->buf, 1, on_after_write)) {
+			route_reply(shard, origin, name, RE_FAILD);
+			pool_free(&shard->pool, wreq->buf.base);
+			free(wreq);
+			fprintf(stderr, "uv_write failed: %s", uv_strerror(rc));
+			return;
+		}
+
+		//返回数据发送成功
+		route_reply(shard, origin, name, RE_OK);
+	}
+}
+
+/**
+  * @brief  在登记所在的事件轮询查询客户端所在的事件轮询并转发命令，消息由本函数释放或转交
+  */
+static void route_dispatch(uni_shard *shard, uni_message *msg) {
+	uni_route *route = registry_find(&shard->registry, msg->name, msg->hash);
+
+	if(!route) {
+		route_offline(shard, msg->origin, msg->name, msg->hash);
+		free(msg);
+	}
+	else if(route->owner == shard->index) {
+		route_command(shard, msg->origin, msg->flag, msg->name, msg->data, msg->size);
+		free(msg);
+	}
+	else {
+		msg->type = MSG_DELIVER;
+		shard_post(route->owner, msg);
+	}
+}
+
+/**
+  * @brief  强制下线同名客户端，仅当其仍是注册序号为 serial 的那次注册时生效
+  */
+static void route_evict(uni_shard *shard, const char *name, uint32_t serial) {
+	uni_client *replaced = table_find(&shard->table, name);
+
+	if(replaced && (replaced->serial == serial)) {
+		//同名新连接已在其它事件轮询注册，与 client_register 相同，清除名称后不再写入断开事件和注销登记
+		table_remove(&shard->table, replaced);
+		replaced->name[0] = 0;
+		client_close(replaced);
+	}
+}
+
+/**
+  * @brief  在登记所在的事件轮询登记客户端，同名客户端在其它事件轮询时强制其下线
+  *         强制下线的消息附带原注册序号，原事件轮询中该名称已重新注册时不会误关新连接
+  */
+static void route_bound(uni_shard *shard, const char *name, uint32_t hash, unsigned int owner, uint32_t serial) {
+	uint32_t replaced = 0;
+	int previous = registry_set(&shard->registry, name, hash, owner, serial, &replaced);
+
+	if((previous < 0) || ((unsigned int)previous == owner)) {
+		return;
+	}
+	if((unsigned int)previous == shard->index) {
+		route_evict(shard, name, replaced);
+	}
+	else {
+		uni_message *msg = message_new(MSG_EVICT, name, hash, (const char *)0, 0);
+		if(msg) {
+			msg->serial = replaced;
+			shard_post(previous, msg);
+		}
+	}
+}
+
+/**
+  * @brief  客户端上线，登记所在的事件轮询
+  */
+static void route_bind(uni_shard *shard, const char *name, uint32_t hash, uint32_t serial) {
+	unsigned int home;
+
+	if(configs.loops < 2) {
+		return;
+	}
+
+	home = route_home(hash);
+	if(home == shard->index) {
+		route_bound(shard, name, hash, shard->index, serial);
+	}
+	else {
+		uni_message *msg = message_new(MSG_BIND, name, hash, (const char *)0, 0);
+		if(msg) {
+			msg->owner = (uint16_t)shard->index;
+			msg->serial = serial;
+			shard_post(home, msg);
+		}
+	}
+}
+
+/**
+  * @brief  批量处理其它事件轮询发来的消息
+  */
+static void on_message(uv_async_t *handle) {
+	uni_shard *shard = shard_of(handle);
+	uni_message *list = __atomic_exchange_n(&shard->inbox, (uni_message *)0, __ATOMIC_ACQUIRE);
+	uni_message *ordered = (uni_message *)0;
+
+	//收件队列为后进先出，反转后按发送顺序处理
+	while(list) {
+		uni_message *msg = list;
+		list = list->next;
+		msg->next = ordered;
+		ordered = msg;
+	}
+
+	while(ordered) {
+		uni_message *msg = ordered;
+		ordered = ordered->next;
+		shard->routed += 1;
+
+		switch(msg->type) {
+			case MSG_BIND:
+				route_bound(shard, msg->name, msg->hash, msg->owner, msg->serial);
+				break;
+			case MSG_UNBIND:
+				registry_unset(&shard->registry, msg->name, msg->hash, msg->owner, msg->serial);
+				if(msg->size == sizeof(packet_meta)) {
+					packet_meta meta;
+					memcpy(&meta, msg->data, sizeof(meta));
+					cache_update(&shard->cache, msg->name, msg->hash, &meta);
+				}
+				break;
+			case MSG_ROUTE:
+				route_dispatch(shard, msg);
+				continue;
+			case MSG_DELIVER:
+				route_command(shard, msg->origin, msg->flag, msg->name, msg->data, msg->size);
+				break;
+			case MSG_REPLY:
+				pipe_write_data(shard, msg->name, (enum __flags)msg->flag, msg->size ? msg->data : NULL, msg->size);
+				break;
+			case MSG_STOP:
+				shard_stop(shard);
+				break;
+			case MSG_EVICT:
+				route_evict(shard, msg->name, msg->serial);
+				break;
+			case MSG_OFFLINE:
+				route_offline(shard, msg->origin, msg->name, msg->hash);
+				break;
+			default:
+				break;
+		}
+		free(msg);
+	}
+}
+
+/**
+  * @brief  处理管道中的一个包，packet 指向包头，size 为包头与数据的字节数
+  */
+static void pipe_on_packet(uni_shard *shard, unsigned int version, const char *packet, size_t size) {
+	char name[32];
+	uint8_t flag;
+	const char *data;
+
+	shard->inq.packets += 1;
+	if(version == PACKET_VERSION_2) {
+		packet_v2 header;
+		if(packet_v2_decode(packet, size, &header) || (header.name_size >= sizeof(name))) {
+			fprintf(stderr, "Invalid packet header\n");
+			return;
+		}
+		if(header.name) {
+			memcpy(name, header.name, header.name_size);
+			name[header.name_size] = 0;
+		}
+		else {
+			//下行只带句柄时按句柄查询名称，已释放或已复用的句柄丢弃，不发给复用该编号的表计
+			if(intern_copy(header.handle, name, sizeof(name))) {
+				fprintf(stderr, "Unknown handle %08x\n", (unsigned int)header.handle);
+				return;
+			}
+		}
+		flag = header.flag;
+		data = header.data;
+		size = header.size;
+	}
+	else {
+		packet_header header;
+		memcpy(&header, packet, sizeof(packet_header));
+		memcpy(name, header.name, sizeof(name));
+		name[sizeof(name) - 1] = 0;
+		flag = header.flag;
+		data = packet + sizeof(packet_header);
+		size -= sizeof(packet_header);
+	}
+
+	//对端确认的包头版本，之后的上行数据使用该版本
+	if(flag == (uint8_t)PH_HELLO) {
+		if((size > 0) && ((uint8_t)data[0] >= PACKET_VERSION_2)) {
+			shard->runs.version = PACKET_VERSION_2;
+			//对端支持句柄时，本连接上的句柄都需要重新附带名称
+			shard->runs.handles = ((size > 1) && (data[1] & PACKET_HANDLE)) ? 1 : 0;
+			if(shard->runs.defined) {
+				memset(shard->runs.defined, 0, shard->runs.defined_size * sizeof(uint32_t));
+			}
+		}
+		return;
+	}
+
+	//单个事件轮询时直接执行
+	if(configs.loops < 2) {
+		route_command(shard, shard->index, flag, name, data, size);
+		return;
+	}
+
+	//多个事件轮询时先发送到登记所在的事件轮询
+	uint32_t hash = table_hash(name);
+	uni_message *msg = message_new(MSG_ROUTE, name, hash, data, size);
+	if(!msg) {
+		pipe_write_data(shard, name, RE_FAILD, NULL, 0);
+		return;
+	}
+	msg->flag = flag;
+	msg->origin = (uint16_t)shard->index;
+	if(route_home(hash) == shard->index) {
+		route_dispatch(shard, msg);
+	}
+	else {
+		shard_post(route_home(hash), msg);
+	}
+}
+
+/**
+  * @brief  管道字节流解析，一次读取中的多个完整包逐个处理，半包保留到下次读取
+  */
+static int pipe_feed(uni_shard *shard, const char *data, size_t size) {
+	uni_inq *inq = &shard->inq;
+	const char *cursor;
+	size_t remain;
+	long n;
+
+	//拼接上次残留的半包
+	if(inq->size) {
+		if((inq->size + size) > inq->capacity) {
+			char *pending = pool_alloc(&shard->pool, inq->size + size);
+			if(!pending) {
+				fprintf(stderr, "No memory for pending packet\n");
+				return -1;
+			}
+			memcpy(pending, inq->data, inq->size);
+			pool_free(&shard->pool, inq->data);
+			inq->data = pending;
+			inq->capacity = pool_capacity(pending);
+		}
+		memcpy(inq->data + inq->size, data, size);
+		inq->size += size;
+		cursor = inq->data;
+		remain = inq->size;
+	}
+	else {
+		cursor = data;
+		remain = size;
+	}
+
+	while(remain > 0) {
+		n = packet_measure(cursor, remain);
+		if(n < 0) {
+			return -1;
+		}
+		if((n == 0) || ((size_t)n > remain)) {
+			break;
+		}
+
+		pipe_on_packet(shard, ((const packet_prefix *)cursor)->version, cursor + sizeof(packet_prefix), (size_t)n - sizeof(packet_prefix));
+		cursor += n;
+		remain -= n;
+	}
+
+	//保存残留的半包
+	if(!remain) {
+		pool_free(&shard->pool, inq->data);
+		inq->data = (char *)0;
+		inq->size = 0;
+		inq->capacity = 0;
+	}
+	else if(inq->size) {
+		if(cursor != inq->data) {
+			memmove(inq->data, cursor, remain);
+			inq->size = remain;
+		}
+	}
+	else {
+		inq->data = pool_alloc(&shard->pool, remain);
+		if(!inq->data) {
+			fprintf(stderr, "No memory for pending packet\n");
+			return -1;
+		}
+		memcpy(inq->data, cursor, remain);
+		inq->size = remain;
+		inq->capacity = pool_capacity(inq->data);
+	}
+
+	return 0;
+}
+
+/**
+  * @brief  管道读数据
+  */
+static void pipe_on_read(uv_stream_t *client, ssize_t nread, const uv_buf_t *buf) {
+	uni_shard *shard = shard_of(client);
+
+	//有数据报文待读取
+	if(nread > 0) {
+		if(pipe_feed(shard, buf->base, nread)) {
+			//字节流无法继续解析，重新连接
+			fprintf(stderr, "Invalid packet from pipe\n");
+			pipe_lost(shard);
+		}
+	}
+	else if (nread < 0) {
+		if (nread != UV_EOF) {
+			fprintf(stderr, "Read pipe error %s\n", uv_err_name(nread));
+		}
+		//上层断开，重新连接
+		pipe_lost(shard);
+	}
+}
+
+/**
+  * @brief  管道建立
+  */
+static void on_pipe_connect(uv_connect_t *connect, int status) {
+	uni_shard *shard = shard_of(connect->handle);
+	int rc;
+	shard->runs.connection = (uv_connect_t *)0;
+	if(status < 0) {
+		if(!shard->runs.attempts && !shard->stopping) {
+			fprintf(stderr, "Invalid pipe connection: %s\n", uv_strerror(status));
+		}
+		pipe_lost(shard);
+	}
+	else {
+		uint8_t hello[2] = {PACKET_VERSION_2, PACKET_HANDLE};
+		if(shard->runs.attempts) {
+			shard->runs.reconnects += 1;
+		}
+		shard->runs.attempts = 0;
+		shard->runs.connection = connect;
+		shard->runs.version = PACKET_VERSION;
+		shard->runs.handles = 0;
+		if(rc = uv_read_start(shard->runs.connection->handle, alloc_buffer, pipe_on_read)) {
+			fprintf(stderr, "uv_read_start failed: %s", uv_strerror(rc));
+		}
+		//以 v1 发送支持的最高版本与选项，对端确认前上行数据使用 v1，不认识的对端忽略该包
+		pipe_write_data(shard, "", PH_HELLO, (const char *)hello, sizeof(hello));
+		//发送上行不可用期间暂存的报文，内存中的报文一次发送
+		shard->store.burst = 1;
+		store_replay(shard);
+	}
+}
+
+
+
+/**
+  * @brief  报文下标转换，负数从尾部计算 (与 string.sub 一致)
+  */
+static lua_Integer packet_position(lua_Integer pos, size_t size) {
+	if(pos < 0) {
+		pos += (lua_Integer)size + 1;
+	}
+	return (pos >= 0) ? pos : 0;
+}
+
+/**
+  * @brief  packet:len()
+  */
+static int packet_len(lua_State *L) {
+	uni_packet *packet = (uni_packet *)luaL_checkudata(L, 1, PACKET_METATABLE);
+
+	lua_pushinteger(L, (lua_Integer)packet->size);
+	return 1;
+}
+
+/**
+  * @brief  packet:byte([i [, j]])
+  */
+static int packet_byte(lua_State *L) {
+	uni_packet *packet = (uni_packet *)luaL_checkudata(L, 1, PACKET_METATABLE);
+	lua_Integer start = packet_position(luaL_optinteger(L, 2, 1), packet->size);
+	lua_Integer end = packet_position(luaL_optinteger(L, 3, start), packet->size);
+	int n;
+
+	if(start <= 0) {
+		start = 1;
+	}
+	if(end > (lua_Integer)packet->size) {
+		end = (lua_Integer)packet->size;
+	}
+	if(start > end) {
+		return 0;
+	}
+
+	n = (int)(end - start + 1);
+	luaL_checkstack(L, n, "packet slice too long");
+	for(int i=0; i<n; i++) {
+		lua_pushinteger(L, (unsigned char)packet->data[start + i - 1]);
+	}
+
+	return n;
+}
+
+/**
+  * @brief  packet:sub([i [, j]])
+  */
+static int packet_sub(lua_State *L) {
+	uni_packet *packet = (uni_packet *)luaL_checkudata(L, 1, PACKET_METATABLE);
+	lua_Integer start = packet_position(luaL_optinteger(L, 2, 1), packet->size);
+	lua_Integer end = packet_position(luaL_optinteger(L, 3, -1), packet->size);
+
+	if(start <= 0) {
+		start = 1;
+	}
+	if(end > (lua_Integer)packet->size) {
+		end = (lua_Integer)packet->size;
+	}
+	if(start > end) {
+		lua_pushliteral(L, "");
+	}
+	else {
+		lua_pushlstring(L, packet->data + start - 1, (size_t)(end - start + 1));
+	}
+
+	return 1;
+}
+
+/**
+  * @brief  按字节序读取整数，越界返回 nil
+  */
+static int packet_integer(lua_State *L, int width) {
+	uni_packet *packet = (uni_packet *)luaL_checkudata(L, 1, PACKET_METATABLE);
+	lua_Integer start = packet_position(luaL_checkinteger(L, 2), packet->size);
+	int little = lua_toboolean(L, 3);
+	uint32_t value = 0;
+
+	if((start <= 0) || ((start + width - 1) > (lua_Integer)packet->size)) {
+		lua_pushnil(L);
+		return 1;
+	}
+
+	for(int i=0; i<width; i++) {
+		unsigned char c = (unsigned char)packet->data[start - 1 + (little ? (width - 1 - i) : i)];
+		value = (value << 8) | c;
+	}
+	lua_pushnumber(L, (lua_Number)value);
+
+	return 1;
+}
+
+/**
+  * @brief  packet:u16(i [, little])
+  */
+static int packet_u16(lua_State *L) {
+	return packet_integer(L, 2);
+}
+
+/**
+  * @brief  packet:u32(i [, little])
+  */
+static int packet_u32(lua_State *L) {
+	return packet_integer(L, 4);
+}
+
+/**
+  * @brief  tostring(packet)
+  */
+static int packet_tostring(lua_State *L) {
+	uni_packet *packet = (uni_packet *)luaL_checkudata(L, 1, PACKET_METATABLE);
+
+	lua_pushlstring(L, packet->data ? packet->data : "", packet->size);
+	return 1;
+}
+
+static const luaL_Reg packet_methods[] = {
+	{"len", packet_len},
+	{"byte", packet_byte},
+	{"sub", packet_sub},
+	{"u16", packet_u16},
+	{"u32", packet_u32},
+	{NULL, NULL}
+};
+
+/**
+  * @brief  创建报文对象，直接引用接收缓冲区，不拷贝数据
+  */
+static uni_packet *packet_new(lua_State *L) {
+	uni_packet *packet;
+
+	if(luaL_newmetatable(L, PACKET_METATABLE)) {
+		lua_newtable(L);
+		luaL_register(L, NULL, packet_methods);
+		lua_setfield(L, -2, "__index");
+		lua_pushcfunction(L, packet_len);
+		lua_setfield(L, -2, "__len");
+		lua_pushcfunction(L, packet_tostring);
+		lua_setfield(L, -2, "__tostring");
+	}
+	lua_pop(L, 1);
+
+	packet = (uni_packet *)lua_newuserdata(L, sizeof(uni_packet));
+	packet->data = (const char *)0;
+	packet->size = 0;
+	luaL_getmetatable(L, PACKET_METATABLE);
+	lua_setmetatable(L, -2);
+
+	return packet;
+}
+
+
+
+/**
+  * @brief  编译脚本并保存到虚拟机注册表，返回引用
+  */
+static int vm_compile(lua_State *L, const char *script, const char *name) {
+	if(luaL_loadbuffer(L, script, strlen(script), name)) {
+		fprintf(stderr, "Script %s error: %s\n", name + 1, lua_tostring(L, -1));
+		lua_pop(L, 1);
+		return LUA_NOREF;
+	}
+
+	return luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+/**
+  * @brief  获取当前工作线程的虚拟机实例，首次调用时创建并编译脚本
+  */
+static uni_vm *vm_get(void) {
+	uni_vm *vm = (uni_vm *)uv_key_get(&vm_key);
+	if(vm) {
+		return vm;
+	}
+
+	vm = (uni_vm *)malloc(sizeof(*vm));
+	if(!vm) {
+		return (uni_vm *)0;
+	}
+	//新建虚拟机实例
+	vm->L = luaL_newstate();
+	if(!vm->L) {
+		free(vm);
+		return (uni_vm *)0;
+	}
+	//初始化虚拟机
+	luaL_openlibs(vm->L);
+	//脚本只编译一次
+	vm->registered = vm_compile(vm->L, configs.script_registered, "=register");
+	vm->heartbeat = vm_compile(vm->L, configs.script_heartbeat, "=heartbeat");
+	if((vm->registered == LUA_NOREF) || (vm->heartbeat == LUA_NOREF)) {
+		lua_close(vm->L);
+		free(vm);
+		return (uni_vm *)0;
+	}
+	//报文对象只创建一次，每次调用仅更新指针和长度
+	vm->packet = packet_new(vm->L);
+	vm->object = luaL_ref(vm->L, LUA_REGISTRYINDEX);
+
+	uv_mutex_lock(&vm_lock);
+	vms.push_back(vm);
+	uv_mutex_unlock(&vm_lock);
+	uv_key_set(&vm_key, vm);
+
+	return vm;
+}
+
+/**
+  * @brief  传入报文对象
+  */
+static void vm_set_packet(uni_vm *vm, const char *data, size_t size) {
+	vm->packet->data = data;
+	vm->packet->size = size;
+	lua_rawgeti(vm->L, LUA_REGISTRYINDEX, vm->object);
+	lua_setglobal(vm->L, "packet");
+}
+
+/**
+  * @brief  执行已编译的脚本，结果保留在栈顶
+  */
+static int vm_call(uni_vm *vm, int script) {
+	lua_rawgeti(vm->L, LUA_REGISTRYINDEX, script);
+	if(lua_pcall(vm->L, 0, 1, 0)) {
+		fprintf(stderr, "Script error: %s\n", lua_tostring(vm->L, -1));
+		lua_pop(vm->L, 1);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+  * @brief  清理单次调用传入的全局变量
+  */
+static void vm_reset(uni_vm *vm) {
+	//报文对象失效，防止脚本保留引用后访问已释放的缓冲区
+	vm->packet->data = (const char *)0;
+	vm->packet->size = 0;
+	lua_settop(vm->L, 0);
+	lua_pushnil(vm->L);
+	lua_setglobal(vm->L, "packet");
+	lua_pushnil(vm->L);
+	lua_setglobal(vm->L, "client");
+}
+
+/**
+  * @brief  检查脚本能否编译
+  */
+static int vm_check(const char *script, const char *name) {
+	lua_State *L = luaL_newstate();
+	int ref;
+
+	if(!L) {
+		return -1;
+	}
+	ref = vm_compile(L, script, name);
+	lua_close(L);
+
+	return (ref == LUA_NOREF) ? -1 : 0;
+}
+
+/**
+  * @brief  关闭所有工作线程的虚拟机实例
+  */
+static void vm_close_all(void) {
+	uv_mutex_lock(&vm_lock);
+	for(size_t n=0; n<vms.size(); n++) {
+		lua_close(vms[n]->L);
+		free(vms[n]);
+	}
+	vms.clear();
+	uv_mutex_unlock(&vm_lock);
+}
+
+
+
+/**
+  * @brief  打开分帧器
+  *   raw                                  单次读取即一帧
+  *   length:<offset>:<width>[:<adjust>][:le]  长度域，帧长 = 长度值 + adjust
+  *   delimiter:<hex>                      以指定字节序列结束
+  *   script:<file>                        脚本返回分帧函数
+  *   dlms                                 DLMS HDLC/TCP wrapper，校验 FCS
+  *   dlt                                  DL/T 645-2007 与 DL/T 698.45，校验 CS/HCS/FCS
+  */
+static int framer_open(uni_framer *framer, const char *spec) {
+	memset(framer, 0, sizeof(*framer));
+	//无法确定最大帧长度的分帧方式使用默认值
+	framer->limit = DEFAULT_FRAME_SIZE;
+
+	if(!spec[0] || (strcmp(spec, "raw") == 0)) {
+		framer->type = FRAMER_RAW;
+		return 0;
+	}
+	else if(strncmp(spec, "length:", 7) == 0) {
+		char *end;
+		framer->type = FRAMER_LENGTH;
+		framer->offset = strtoul(spec + 7, &end, 10);
+		if(*end != ':') {
+			return -1;
+		}
+		framer->width = strtoul(end + 1, &end, 10);
+		if((framer->width != 1) && (framer->width != 2) && (framer->width != 4)) {
+			return -1;
+		}
+		if(*end == ':' && (strcmp(end + 1, "le") != 0)) {
+			framer->adjust = strtol(end + 1, &end, 10);
+		}
+		if(strcmp(end, ":le") == 0) {
+			framer->little = 1;
+		}
+		else if(*end) {
+			return -1;
+		}
+		//长度域能表示的最大帧长度，不超过 MAX_FRAME_SIZE
+		if(framer->width < 4) {
+			long limit = (long)((1UL << (framer->width * 8)) - 1) + framer->adjust;
+			framer->limit = (limit > DEFAULT_FRAME_SIZE) ? (size_t)limit : DEFAULT_FRAME_SIZE;
+		}
+		else {
+			framer->limit = MAX_FRAME_SIZE;
+		}
+		return 0;
+	}
+	else if(strncmp(spec, "delimiter:", 10) == 0) {
+		const char *hex = spec + 10;
+		framer->type = FRAMER_DELIMITER;
+		if(!hex[0] || (strlen(hex) % 2) || ((strlen(hex) / 2) > sizeof(framer->delimiter))) {
+			return -1;
+		}
+		for(framer->delimiter_size=0; hex[framer->delimiter_size * 2]; framer->delimiter_size++) {
+			unsigned int c;
+			if(sscanf(hex + framer->delimiter_size * 2, "%2x", &c) != 1) {
+				return -1;
+			}
+			framer->delimiter[framer->delimiter_size] = (unsigned char)c;
+		}
+		return 0;
+	}
+	else if(strcmp(spec, "dlms") == 0) {
+		framer->type = FRAMER_DLMS;
+		framer->limit = DLMS_FRAME_MAX;
+		return 0;
+	}
+	else if(strcmp(spec, "dlt") == 0) {
+		framer->type = FRAMER_DLT;
+		framer->limit = DLT_FRAME_MAX;
+		return 0;
+	}
+	else if(strncmp(spec, "script:", 7) == 0) {
+		framer->type = FRAMER_SCRIPT;
+		framer->L = luaL_newstate();
+		if(!framer->L) {
+			return -1;
+		}
+		luaL_openlibs(framer->L);
+		if(luaL_loadfile(framer->L, spec + 7) || lua_pcall(framer->L, 0, 1, 0)) {
+			fprintf(stderr, "Script %s error: %s\n", spec + 7, lua_tostring(framer->L, -1));
+			lua_close(framer->L);
+			framer->L = (lua_State *)0;
+			return -1;
+		}
+		if(!lua_isfunction(framer->L, -1)) {
+			fprintf(stderr, "Script %s must return a function\n", spec + 7);
+			lua_close(framer->L);
+			framer->L = (lua_State *)0;
+			return -1;
+		}
+		framer->function = luaL_ref(framer->L, LUA_REGISTRYINDEX);
+		framer->packet = packet_new(framer->L);
+		lua_setglobal(framer->L, "packet");
+		return 0;
+	}
+
+	return -1;
+}
+
+/**
+  * @brief  关闭分帧器
+  */
+static void framer_close(uni_framer *framer) {
+	if(framer->L) {
+		lua_close(framer->L);
+		framer->L = (lua_State *)0;
+	}
+}
+
+/**
+  * @brief  计算首帧长度
+  * @retval >0 帧长度 (可能大于已有数据)，0 数据不足，<0 丢弃的字节数
+  */
+static long framer_measure(uni_framer *framer, const char *data, size_t size) {
+	const unsigned char *p = (const unsigned char *)data;
+
+	switch(framer->type) {
+		case FRAMER_LENGTH: {
+			unsigned long value = 0;
+			long length;
+			if(size < (framer->offset + framer->width)) {
+				return 0;
+			}
+			for(unsigned int i=0; i<framer->width; i++) {
+				value = (value << 8) | p[framer->offset + (framer->little ? (framer->width - 1 - i) : i)];
+			}
+			length = (long)value + framer->adjust;
+			if(length < (long)(framer->offset + framer->width)) {
+				return -1;
+			}
+			return length;
+		}
+		case FRAMER_DELIMITER: {
+			if(size < framer->delimiter_size) {
+				return 0;
+			}
+			for(size_t i=0; i<=(size - framer->delimiter_size); i++) {
+				if((p[i] == framer->delimiter[0]) && \
+				(memcmp(p + i, framer->delimiter, framer->delimiter_size) == 0)) {
+					return (long)(i + framer->delimiter_size);
+				}
+			}
+			return 0;
+		}
+		case FRAMER_SCRIPT: {
+			long length;
+			framer->packet->data = data;
+			framer->packet->size = size;
+			lua_rawgeti(framer->L, LUA_REGISTRYINDEX, framer->function);
+			lua_getglobal(framer->L, "packet");
+			if(lua_pcall(framer->L, 1, 1, 0)) {
+				fprintf(stderr, "Framing script error: %s\n", lua_tostring(framer->L, -1));
+				length = -(long)size;
+			}
+			else {
+				length = (long)lua_tonumber(framer->L, -1);
+			}
+			lua_settop(framer->L, 0);
+			framer->packet->data = (const char *)0;
+			framer->packet->size = 0;
+			return length;
+		}
+		case FRAMER_DLMS:
+			return dlms_measure(p, size);
+		case FRAMER_DLT:
+			return dlt_measure(p, size);
+		default:
+			return (long)size;
+	}
+}
+
+/**
+  * @brief  本地编解码器判断帧类型，无需发送到其它线程
+  */
+static enum __frame_class framer_classify(uni_framer *framer, const char *data, size_t size) {
+	const unsigned char *p = (const unsigned char *)data;
+
+	switch(framer->type) {
+		case FRAMER_DLMS:
+			switch(dlms_classify(p, size)) {
+				case DLMS_KEEPALIVE:
+					return FRAME_HEARTBEAT;
+				case DLMS_ASSOCIATION:
+				case DLMS_EVENT:
+				case DLMS_DATA:
+					return FRAME_DATA;
+				default:
+					return FRAME_UNKNOWN;
+			}
+		case FRAMER_DLT:
+			switch(dlt_classify(p, size)) {
+				case DLT_LOGIN:
+				case DLT_HEARTBEAT:
+					return FRAME_HEARTBEAT;
+				case DLT_LOGOUT:
+				case DLT_DATA:
+					return FRAME_DATA;
+				default:
+					return FRAME_UNKNOWN;
+			}
+		default:
+			return FRAME_UNKNOWN;
+	}
+}
+
+/**
+  * @brief  本地编解码器从登录帧提取客户端名称
+  * @retval 0 成功，-1 交由脚本判断
+  */
+static int framer_identify(uni_framer *framer, const char *data, size_t size, char *name, size_t length) {
+	const unsigned char *p = (const unsigned char *)data;
+
+	switch(framer->type) {
+		case FRAMER_DLT:
+			return dlt_login(p, size, name, length) ? 0 : -1;
+		default:
+			return -1;
+	}
+}
+
+
+
+/**
+  * @brief  在事件轮询线程中写入客户端名称并登记到在线表
+  *         frame 为注册脚本识别的登录帧，保存后下次启动可直接识别，其它方式注册时为空
+  */
+static void client_register(uni_client *client, const char *name, const char *frame, unsigned int size) {
+	if(!name[0] || client->name[0] || uv_is_closing((uv_handle_t *)client)) {
+		return;
+	}
+
+	strcpy(client->name, name);
+	//每次注册的序号，区分同名客户端的先后注册
+	client->serial = ++shard_of(client)->serial;
+	client->id = intern_handle(client->name);
+	client->hash = client->id ? intern_name(client->id)->hash : table_hash(client->name);
+	uni_client *replaced = table_insert(&shard_of(client)->table, client);
+	if(replaced && (replaced != client)) {
+		//同名旧连接强制下线
+		replaced->name[0] = 0;
+		client_close(replaced);
+	}
+	//登记所在的事件轮询，其它事件轮询中的同名旧连接强制下线
+	route_bind(shard_of(client), client->name, client->hash, client->serial);
+	db_register(client->name, client->ip, client->port, frame, size, configs.profile);
+}
+
+/**
+  * @brief  注册报文判断完成
+  */
+static void on_after_register(uv_work_t *req, int status) {
+	uni_classifier *work_req = (uni_classifier *)req;
+	uni_shard *shard = shard_of(work_req->client);
+
+	if(!status) {
+		client_register(work_req->client, work_req->name, work_req->packet, work_req->size);
+	}
+
+	pool_free(&shard->pool, work_req->packet);
+	//释放引用后客户端可能已归还内存池，最后执行
+	client_release(work_req->client);
+	free(req);
+}
+
+/**
+  * @brief  注册报文判断
+  */
+static void on_register(uv_work_t *req) {
+	//获取本线程的虚拟机实例
+	uni_vm *vm = vm_get();
+	if(!vm) {
+		return;
+	}
+	lua_State *L = vm->L;
+	//传入报文
+	vm_set_packet(vm, ((uni_classifier *)req)->packet, ((uni_classifier *)req)->size);
+	//执行脚本
+	if(vm_call(vm, vm->registered) == 0) {
+		//获取返回值
+		char *result = (char *)lua_tostring(L, -1);
+		if(result && (strlen(result) > 0) && (strlen(result) < sizeof(((uni_classifier *)req)->name))) {
+			//暂存客户端名称，完成后由事件轮询线程写入
+			strcpy(((uni_classifier *)req)->name, result);
+		}
+	}
+	//重置虚拟机实例
+	vm_reset(vm);
+}
+
+/**
+  * @brief  心跳报文判断完成
+  */
+static void on_after_heartbeat(uv_work_t *req, int status) {
+	uni_client *client = ((uni_classifier *)req)->client;
+	uni_shard *shard = shard_of(client);
+
+	//在事件轮询线程中更新时间戳
+	if(!status && ((uni_classifier *)req)->result) {
+		client->timestamp = time(NULL);
+		if(!uv_is_closing((uv_handle_t *)client)) {
+			seen_touch(shard, client);
+		}
+	}
+	pool_free(&shard->pool, ((uni_classifier *)req)->packet);
+	//释放引用后客户端可能已归还内存池，最后执行
+	client_release(client);
+	free(req);
+}
+
+/**
+  * @brief  心跳报文判断
+  */
+static void on_heartbeat(uv_work_t *req) {
+	//获取本线程的虚拟机实例
+	uni_vm *vm = vm_get();
+	if(!vm) {
+		return;
+	}
+	lua_State *L = vm->L;
+	//传入报文
+	vm_set_packet(vm, ((uni_classifier *)req)->packet, ((uni_classifier *)req)->size);
+	//传入客户端名称
+	lua_pushstring(L, ((uni_classifier *)req)->name);
+	lua_setglobal(L, "client");
+	//执行脚本
+	if(vm_call(vm, vm->heartbeat) == 0) {
+		//暂存结果，完成后由事件轮询线程更新
+		((uni_classifier *)req)->result = lua_toboolean(L, -1);
+	}
+	//重置虚拟机实例
+	vm_reset(vm);
+}
+
+/**
+  * @brief  将报文拷贝后发送到其它线程判断
+  */
+static int classifier_queue(uni_client *client, const char *data, unsigned int size, uv_work_cb work, uv_after_work_cb after) {
+	uni_shard *shard = shard_of(client);
+	int rc;
+
+	uni_classifier *work_req = (uni_classifier *)malloc(sizeof(*work_req));
+	if(!work_req) {
+		fprintf(stderr, "No memory for work_req\n");
+		return -1;
+	}
+
+	memset(work_req, 0, sizeof(*work_req));
+	work_req->packet = pool_alloc(&shard->pool, size);
+	if(!work_req->packet) {
+		free(work_req);
+		fprintf(stderr, "No memory for work_req\n");
+		return -1;
+	}
+	memcpy(work_req->packet, data, size);
+	//工作线程只访问请求中的拷贝，客户端只由事件轮询线程读写
+	strcpy(work_req->name, client->name);
+	work_req->client = client;
+	work_req->size = size;
+	if((rc = uv_queue_work(shard->loop, (uv_work_t *)work_req, work, after))) {
+		pool_free(&shard->pool, work_req->packet);
+		free(work_req);
+		fprintf(stderr, "uv_queue_work failed: %s", uv_strerror(rc));
+		return -1;
+	}
+	//工作完成前客户端不回收
+	client->refs += 1;
+
+	return 0;
+}
+
+/**
+  * @brief  处理一个完整的报文帧，block 为报文所在的接收缓冲区 (报文在残留半帧中时为空)
+  */
+static void on_frame(uni_client *client, char *block, const char *data, unsigned int size) {
+	uni_shard *shard = shard_of(client);
+
+	//判断是否已经注册
+	if(!(client->name[0])) {
+		char name[32];
+
+		//本地编解码器可识别的登录帧直接注册
+		if(framer_identify(&shard->framer, data, size, name, sizeof(name)) == 0) {
+			client_register(client, name, (const char *)0, 0);
+			return;
+		}
+
+		//判断是否为注册报文
+		//长度小于等于 DEFAULT_AUTH_PACKET_SIZE 字节的报文才有可能是注册帧
+		if(size <= DEFAULT_AUTH_PACKET_SIZE) {
+			//上次运行由注册脚本识别过的登录帧直接注册
+			const char *known_name = known_find(data, size);
+			if(known_name) {
+				shard->runs.recognized += 1;
+				client_register(client, known_name, (const char *)0, 0);
+				return;
+			}
+
+			//启动注册流程
+			//将注册工作发送到其它线程
+			classifier_queue(client, data, size, on_register, on_after_register);
+		}
+	}
+	else {
+		//本地编解码器可识别的帧直接处理
+		switch(framer_classify(&shard->framer, data, size)) {
+			case FRAME_HEARTBEAT:
+				client->timestamp = time(NULL);
+				seen_touch(shard, client);
+				pipe_write_frame(shard, client->id, client->name, PH_TRANSMIT, block, data, size);
+				return;
+			case FRAME_DATA:
+				pipe_write_frame(shard, client->id, client->name, PH_TRANSMIT, block, data, size);
+				return;
+			default:
+				break;
+		}
+
+		//判断是否为心跳报文
+		//长度小于等于 DEFAULT_AUTH_PACKET_SIZE 字节的报文才有可能是心跳帧
+		if(size <= DEFAULT_AUTH_PACKET_SIZE) {
+			//启动心跳流程
+			//将心跳处理发送到其它线程
+			if(classifier_queue(client, data, size, on_heartbeat, on_after_heartbeat)) {
+				return;
+			}
+		}
+
+		//报文从管道发送到上层
+		pipe_write_frame(shard, client->id, client->name, PH_TRANSMIT, block, data, size);
+	}
+}
+
+/**
+  * @brief  报文重组，一次读取中的多个完整帧逐个处理，半帧保留到下次读取
+  */
+static int client_feed(uni_client *client, char *block, const char *data, size_t size) {
+	const char *cursor;
+	size_t remain;
+	long n;
+	uni_shard *shard = shard_of(client);
+
+	//拼接上次残留的半帧
+	if(client->pending_size) {
+		if((client->pending_size + size) > client->pending_capacity) {
+			char *pending = pool_alloc(&shard->pool, client->pending_size + size);
+			if(!pending) {
+				fprintf(stderr, "No memory for pending frame\n");
+				return -1;
+			}
+			memcpy(pending, client->pending, client->pending_size);
+			pool_free(&shard->pool, client->pending);
+			client->pending = pending;
+			client->pending_capacity = pool_capacity(pending);
+		}
+		memcpy(client->pending + client->pending_size, data, size);
+		client->pending_size += size;
+		//残留半帧之后会被改写，不能直接引用
+		block = (char *)0;
+		cursor = client->pending;
+		remain = client->pending_size;
+	}
+	else {
+		cursor = data;
+		remain = size;
+	}
+
+	while(remain > 0) {
+		n = framer_measure(&shard->framer, cursor, remain);
+		if(n < 0) {
+			//丢弃无法识别的字节
+			n = ((size_t)(-n) < remain) ? -n : (long)remain;
+			cursor += n;
+			remain -= n;
+			continue;
+		}
+		if((n == 0) || ((size_t)n > remain)) {
+			//半帧超过分帧方式的最大帧长度视为错误
+			if(((size_t)n > shard->framer.limit) || (remain >= shard->framer.limit)) {
+				return -1;
+			}
+			break;
+		}
+
+		on_frame(client, block, cursor, (unsigned int)n);
+		cursor += n;
+		remain -= n;
 	}
-	//初始化虚拟机
-	luaL_openlibs(L);
-	//传入报文
-	lua_newtable(L);
-	lua_pushnumber(L, -1);
-	lua_rawseti(L, -2, 0);
-	for(int n=0; n<((uni_classifier *)req)->size; n++) {
-		lua_pushinteger(L, ((uni_classifier *)req)->packet[n]);
-		lua_rawseti(L, -2, n+1);
-	}
-	lua_setglobal(L, "packet");
-	//传入客户端名称
-	lua_newtable(L);
-	lua_pushnumber(L, -1);
-	lua_rawseti(L, -2, 0);
-	for(int n=0; n<strlen(((uni_classifier *)req)->client->name); n++) {
-		lua_pushinteger(L, ((uni_classifier *)req)->client->name[n]);
-		lua_rawseti(L, -2, n+1);
+
+	//保存残留的半帧
+	if(!remain) {
+		pool_free(&shard->pool, client->pending);
+		client->pending = (char *)0;
+		client->pending_size = 0;
+		client->pending_capacity = 0;
 	}
-	lua_setglobal(L, "client");
-	//执行脚本
-	luaL_dostring(L, configs.script_heartbeat);
-	//获取返回值
-	int result = lua_toboolean(L, -1);
-	//返回结果
-	if(result) {
-		((uni_classifier *)req)->client->timestamp = time(NULL);
-	}
-	//关闭虚拟机实例
-	lua_close(L);
+	else if(client->pending_size) {
+		if(cursor != client->pending) {
+			memmove(client->pending, cursor, remain);
+			client->pending_size = remain;
+		}
+	}
+	else {
+		client->pending = pool_alloc(&shard->pool, remain);
+		if(!client->pending) {
+			fprintf(stderr, "No memory for pending frame\n");
+			return -1;
+		}
+		memcpy(client->pending, cursor, remain);
+		client->pending_size = remain;
+		client->pending_capacity = pool_capacity(client->pending);
+	}
+
+	return 0;
 }
 
 /**
   * @brief  读取数据
   */
 static void on_read(uv_stream_t *client, ssize_t nread, const uv_buf_t *buf) {
-	int rc;
+	uni_shard *shard = shard_of(client);
 
 	//有数据报文待读取
 	if(nread > 0) {
-		if((((uni_client *)client)->timestamp < time(NULL)) && \
-		((time(NULL) - ((uni_client *)client)->timestamp) > configs.timeout)) {
-			//该客户端已经超时，关闭并推送到gc列表
-			uv_close((uv_handle_t *)client, NULL);
-			int retry = 50;
-			while(uv_mutex_trylock(&runs.lock) != 0) {
-				if(!retry) {
-					free(buf->base);
-					return;
-				}
-				retry -= 1;
-#if defined ( WIN32 )
-				Sleep(1);
-#else
-				usleep(1*1000);
-#endif
-			}
-			gc.push((uni_client *)client);
-			uv_mutex_unlock(&runs.lock);
-			free(buf->base);
-			return;
-		}
-
-		//判断是否已经注册
-		if(!(((uni_client *)client)->name[0])) {
-			//判断是否为注册报文
-			//长度小于等于 DEFAULT_AUTH_PACKET_SIZE 字节的报文才有可能是注册帧
-			if(nread <= DEFAULT_AUTH_PACKET_SIZE) {
-				//启动注册流程
-				//将注册工作发送到其它线程
-				uni_classifier *work_req = (uni_classifier *)malloc(sizeof(*work_req));
-				if(!work_req) {
-					free(buf->base);
-					fprintf(stderr, "No memory for work_req\n");
-					return;
-				}
+		//统计流量，上行拥塞时暂停流量大的客户端
+		flow_account(shard, (uni_client *)client, nread);
 
-				memset(work_req, 0, sizeof(*work_req));
-				work_req->client = (uni_client *)client;
-				work_req->packet = buf->base;
-				work_req->size = nread;
-				if((rc = uv_queue_work(loop, (uv_work_t *)work_req, on_register, on_after_register))) {
-					free(work_req);
-					free(buf->base);
-					fprintf(stderr, "uv_queue_work failed: %s", uv_strerror(rc));
-					return;
-				}
-				else {
-					return;
-				}
-			}
+		//分帧处理，本次读取的报文使用同一接收时间
+		shard->stamp = clock_now();
+		if(client_feed((uni_client *)client, shard->recv, buf->base, nread)) {
+			fprintf(stderr, "Invalid frame from client\n");
+			db_event(DB_ERROR, ((uni_client *)client)->name, ((uni_client *)client)->ip, ((uni_client *)client)->port, "invalid frame");
+			client_close((uni_client *)client);
 		}
-		else {
-			char name[32];
-			strcpy(name, ((uni_client *)client)->name);
-
-			//判断是否为心跳报文
-			//长度小于等于 DEFAULT_AUTH_PACKET_SIZE 字节的报文才有可能是心跳帧
-			if(nread <= DEFAULT_AUTH_PACKET_SIZE) {
-				//启动心跳流程
-				//将心跳处理发送到其它线程
-				uni_classifier *work_req = (uni_classifier *)malloc(sizeof(*work_req));
-				if(!work_req) {
-					free(buf->base);
-					fprintf(stderr, "No memory for work_req\n");
-					return;
-				}
-
-				memset(work_req, 0, sizeof(*work_req));
-				work_req->client = (uni_client *)client;
-				work_req->packet = buf->base;
-				work_req->size = nread;
-				if((rc = uv_queue_work(loop, (uv_work_t *)work_req, on_heartbeat, on_after_heartbeat))) {
-					free(work_req);
-					free(buf->base);
-					fprintf(stderr, "uv_queue_work failed: %s", uv_strerror(rc));
-					return;
-				}
-				else {
-					//报文从管道发送到上层
-					pipe_write_data(name, PH_TRANSMIT, buf->base, nread);
-					return;
-				}
-			}
-			else {
-				//报文从管道发送到上层
-				pipe_write_data(name, PH_TRANSMIT, buf->base, nread);
-			}
+		shard->stamp = 0;
+		//本次读取的数据被上行队列引用时，之后的读取使用接收缓冲区的剩余部分
+		if(pool_refs(shard->recv) > 1) {
+			shard->recv_used += (nread + 7) & ~7;
 		}
 	}
 	else if (nread < 0) {
 		if (nread != UV_EOF) {
 			fprintf(stderr, "Read error %s\n", uv_err_name(nread));
+			db_event(DB_ERROR, ((uni_client *)client)->name, ((uni_client *)client)->ip, ((uni_client *)client)->port, uv_err_name(nread));
 		}
-		//该客户端已经出错，关闭并推送到gc列表
-		uv_close((uv_handle_t *)client, NULL);
-		int retry = 50;
-		while(uv_mutex_trylock(&runs.lock) != 0) {
-			if(!retry) {
-				free(buf->base);
-				return;
-			}
-			retry -= 1;
-#if defined ( WIN32 )
-			Sleep(1);
-#else
-			usleep(1*1000);
-#endif
-		}
-		gc.push((uni_client *)client);
-		uv_mutex_unlock(&runs.lock);
+		//该客户端已经出错，关闭并回收
+		client_close((uni_client *)client);
 	}
-
-	free(buf->base);
 }
 
 
@@ -462,6 +4249,7 @@ static void on_read(uv_stream_t *client, ssize_t nread, const uv_buf_t *buf) {
   * @brief  新连接
   */
 static void on_new_connection(uv_stream_t *server, int status) {
+	uni_shard *shard = shard_of(server);
 	int rc;
 
 	if (status < 0) {
@@ -470,14 +4258,14 @@ static void on_new_connection(uv_stream_t *server, int status) {
 	}
 
 	//生成客户端
-	uni_client *client = (uni_client *)malloc(sizeof(uni_client));
+	uni_client *client = slab_alloc(&shard->slab);
 	if(!client) {
 		fprintf(stderr, "No memory for client\n");
 		return;
 	}
 	//初始化客户端
-	if((rc = uv_tcp_init(loop, &client->handle))) {
-		free(client);
+	if((rc = uv_tcp_init(shard->loop, &client->handle))) {
+		slab_free(&shard->slab, client);
 		fprintf(stderr, "uv_tcp_init failed: %s", uv_strerror(rc));
 		return;
 	}
@@ -505,6 +4293,9 @@ static void on_new_connection(uv_stream_t *server, int status) {
 			fprintf(stderr, "uv_read_start failed: %s", uv_strerror(rc));
 			return;
 		}
+
+		//加入时间轮
+		wheel_insert(&shard->wheel, client, client->timestamp + configs.timeout);
 	}
 	else {
 		//不接受客户端连接
@@ -515,71 +4306,435 @@ static void on_new_connection(uv_stream_t *server, int status) {
 
 
 /**
-  * @brief  定时器回调
+  * @brief  事件轮询延迟采样，定时器实际间隔超出 PROBE_INTERVAL 的部分按 2 的幂 (微秒) 分桶
   */
-static void on_timer_triggered(uv_timer_t *handle) {
-	static bool running = false;
-	static uint64_t size = 0;
+static void on_probe(uv_timer_t *handle) {
+	uni_probe *probe = &shard_of(handle)->probe;
+	uint64_t now = uv_hrtime();
+	uint64_t lag = (now - probe->last) / 1000;
+	unsigned int index = 0;
 
-	//防止重入
-	if(running == true) {
-		return;
+	probe->last = now;
+	lag = (lag > (PROBE_INTERVAL * 1000)) ? (lag - PROBE_INTERVAL * 1000) : 0;
+	while(((lag >> index) > 1) && (index < (PROBE_BUCKETS - 1))) {
+		index += 1;
+	}
+	probe->buckets[index] += 1;
+	probe->samples += 1;
+	if(lag > probe->max) {
+		probe->max = lag;
+	}
+}
+
+/**
+  * @brief  事件轮询延迟百分位 (所在桶的上限，微秒)
+  */
+static uint64_t probe_percentile(uni_probe *probe, unsigned int percent) {
+	unsigned long count = 0;
+
+	for(unsigned int index=0; index<PROBE_BUCKETS; index++) {
+		count += probe->buckets[index];
+		if((count * 100) >= (probe->samples * percent)) {
+			return ((uint64_t)2) << index;
+		}
+	}
+
+	return probe->max;
+}
+
+/**
+  * @brief  运行统计定时器回调
+  */
+static void on_stats(uv_timer_t *handle) {
+	uni_shard *shard = shard_of(handle);
+	uni_probe *probe = &shard->probe;
+	unsigned long total = shard->pool.hits + shard->pool.misses;
+
+	fprintf(stdout, "[%u] clients %lu/%lu online %lu expired %lu routed %lu reads %lu pool hits %lu misses %lu rate %.1f%%\n", \
+	shard->index, shard->slab.used, shard->slab.total, shard->table.size, shard->wheel.expired, shard->routed, \
+	shard->pool.reads, shard->pool.hits, shard->pool.misses, total ? ((double)shard->pool.hits * 100.0 / (double)total) : 0.0);
+	fprintf(stdout, "[%u] upstream frames %lu copied %lu batches %lu direct %lu queued %lu downstream %lu\n", \
+	shard->index, shard->outq.frames, shard->outq.copied, shard->outq.batches, shard->outq.direct, shard->outq.queued, \
+	shard->inq.packets);
+	fprintf(stdout, "[%u] flow queued %lu congested %lu/%llums paused %lu now %lu/%llums\n", \
+	shard->index, (unsigned long)flow_queued(shard), shard->flow.congestions, \
+	(unsigned long long)(shard->flow.congested_ms + (shard->flow.congested ? (uv_now(shard->loop) - shard->flow.since) : 0)), \
+	shard->flow.pauses, shard->flow.count, (unsigned long long)shard->flow.paused_ms);
+	fprintf(stdout, "[%u] store stored %lu spooled %lu replayed %lu dropped %lu memory %lu disk %llu reconnects %lu\n", \
+	shard->index, shard->store.stored, shard->store.spooled, shard->store.replayed, shard->store.dropped, \
+	(unsigned long)shard->store.memory, (unsigned long long)shard->store.spilled, shard->runs.reconnects);
+	if(!shard->index) {
+		//统计值只用于输出，不加锁读取
+		fprintf(stdout, "[names] live %lu handles %lu recycled %lu exhausted %lu\n", \
+		intern.size, (unsigned long)(intern.count - 1), intern.recycled, intern.exhausted);
+	}
+	if(!shard->index && configs.database[0]) {
+		db_stats db;
+		db_statistics(&db);
+		fprintf(stdout, "[db] pending %lu written %lu dropped %lu commits %lu seen %lu reads %lu/%lu pruned %lu last %lluus\n", \
+		db.pending, db.written, db.dropped, db.commits, db.seen, db.reads, db.readers, db.pruned, (unsigned long long)db.commit_us);
+	}
+	if(configs.database[0]) {
+		fprintf(stdout, "[%u] heartbeats %lu dirty %lu flushed %lu recognized %lu/%lu\n", \
+		shard->index, shard->seen.heartbeats, shard->seen.count, shard->seen.flushed, shard->runs.recognized, known.count);
+	}
+	if(shard->cache.capacity) {
+		unsigned long lookups = shard->cache.hits + shard->cache.misses;
+		fprintf(stdout, "[%u] cache hits %lu misses %lu waits %lu evictions %lu entries %lu/%lu rate %.1f%%\n", \
+		shard->index, shard->cache.hits, shard->cache.misses, shard->cache.waits, shard->cache.evictions, \
+		shard->cache.used, shard->cache.capacity, lookups ? ((double)shard->cache.hits * 100.0 / (double)lookups) : 0.0);
+	}
+	if(probe->samples) {
+		fprintf(stdout, "[%u] loop p50 <%lluus p99 <%lluus max %lluus\n", \
+		shard->index, (unsigned long long)probe_percentile(probe, 50), (unsigned long long)probe_percentile(probe, 99), \
+		(unsigned long long)probe->max);
+	}
+	fflush(stdout);
+
+	//延迟按统计周期重新采样
+	probe->max = 0;
+	probe->samples = 0;
+	memset(probe->buckets, 0, sizeof(probe->buckets));
+}
+
+
+
+/**
+  * @brief  打开监听端口，多个事件轮询时设置 SO_REUSEPORT 由内核分配新连接
+  */
+static int shard_listen(uni_shard *shard) {
+	struct sockaddr_in addr;
+	int rc;
+
+	if(rc = uv_tcp_init(shard->loop, &shard->server)) {
+		fprintf(stderr, "uv_tcp_init failed: %s", uv_strerror(rc));
+		return -1;
+	}
+
+#if defined(SO_REUSEPORT)
+	if(configs.loops > 1) {
+		int on = 1;
+		uv_os_sock_t sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if(sock < 0) {
+			fprintf(stderr, "socket failed: %s\n", strerror(errno));
+			return -1;
+		}
+		if(setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on))) {
+			fprintf(stderr, "setsockopt SO_REUSEPORT failed: %s\n", strerror(errno));
+			close(sock);
+			return -1;
+		}
+		if(rc = uv_tcp_open(&shard->server, sock)) {
+			fprintf(stderr, "uv_tcp_open failed: %s", uv_strerror(rc));
+			close(sock);
+			return -1;
+		}
+	}
+#endif
+
+	//设置监听IP和PORT
+	if(rc = uv_ip4_addr("0.0.0.0", configs.port, &addr)) {
+		fprintf(stderr, "uv_ip4_addr failed: %s", uv_strerror(rc));
+		return -1;
+	}
+	if(rc = uv_tcp_bind(&shard->server, (const struct sockaddr *)&addr, 0)) {
+		fprintf(stderr, "uv_tcp_bind failed: %s", uv_strerror(rc));
+		return -1;
+	}
+
+	//开始监听
+	if(rc = uv_listen((uv_stream_t *)&shard->server, DEFAULT_BACKLOG, on_new_connection)) {
+		fprintf(stderr, "uv_listen failed %s\n", uv_strerror(rc));
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+  * @brief  初始化事件轮询分片：事件轮询 在线表 内存池 分帧器 上行管道 监听端口 定时器
+  */
+static int shard_open(uni_shard *shard, unsigned int index) {
+	int rc;
+
+	shard->index = index;
+	if(!index) {
+		shard->loop = uv_default_loop();
+	}
+	else {
+		shard->loop = (uv_loop_t *)malloc(sizeof(uv_loop_t));
+		if(!shard->loop) {
+			fprintf(stderr, "No memory for loop\n");
+			return -1;
+		}
+		if((rc = uv_loop_init(shard->loop))) {
+			free(shard->loop);
+			shard->loop = (uv_loop_t *)0;
+			fprintf(stderr, "uv_loop_init failed %s\n", uv_strerror(rc));
+			return -1;
+		}
+	}
+	shard->loop->data = shard;
+
+	//分帧器，脚本分帧器的虚拟机只在本事件轮询中使用
+	if(framer_open(&shard->framer, configs.framing)) {
+		fprintf(stderr, "Invalid parameter : framing\n");
+		return -1;
+	}
+
+	//初始化在线客户端表
+	if(table_init(&shard->table, configs.max_clients / configs.loops)) {
+		fprintf(stderr, "No memory for client table\n");
+		return -1;
+	}
+
+	//初始化客户端内存池
+	if(slab_init(&shard->slab, configs.max_clients / configs.loops)) {
+		fprintf(stderr, "No memory for client slab\n");
+		return -1;
+	}
+
+	//多个事件轮询时，客户端登记表与消息队列
+	if(configs.loops > 1) {
+		if(registry_init(&shard->registry, configs.max_clients / configs.loops)) {
+			fprintf(stderr, "No memory for client registry\n");
+			return -1;
+		}
+		if(rc = uv_async_init(shard->loop, &shard->async, on_message)) {
+			fprintf(stderr, "uv_async_init failed %s\n", uv_strerror(rc));
+			return -1;
+		}
+	}
+
+	//上行不可用时的暂存队列
+	if(store_open(shard)) {
+		return -1;
+	}
+
+	//上行管道，每个事件轮询一个连接
+	if(rc = uv_pipe_init(shard->loop, &shard->pipe, 0)) {
+		fprintf(stderr, "uv_pipe_init failed %s\n", uv_strerror(rc));
+		return -1;
+	}
+	uv_pipe_connect(&shard->connect, &shard->pipe, (const char *)configs.sock, on_pipe_connect);
+	if(rc = uv_timer_init(shard->loop, &shard->runs.retry)) {
+		fprintf(stderr, "uv_timer_init failed: %s", uv_strerror(rc));
+		return -1;
+	}
+	shard->outq.ring = (uni_head *)malloc(DEFAULT_RING_SIZE * sizeof(uni_head));
+	if(!shard->outq.ring) {
+		fprintf(stderr, "No memory for upstream queue\n");
+		return -1;
+	}
+	if(rc = uv_check_init(shard->loop, &shard->outq.check)) {
+		fprintf(stderr, "uv_check_init failed %s\n", uv_strerror(rc));
+		return -1;
+	}
+
+	//监听端口
+	if(shard_listen(shard)) {
+		return -1;
+	}
+
+	//超时时间轮
+	shard->wheel.tick = time(NULL);
+	if(rc = uv_timer_init(shard->loop, &shard->wheel.timer)) {
+		fprintf(stderr, "uv_timer_init failed: %s", uv_strerror(rc));
+		return -1;
+	}
+	if(rc = uv_timer_start(&shard->wheel.timer, on_wheel, 1000, 1000)) {
+		fprintf(stderr, "uv_timer_start failed %s\n", uv_strerror(rc));
+		return -1;
+	}
+
+	//不在线客户端的状态缓存
+	if(configs.database[0] && configs.cache) {
+		if(cache_init(&shard->cache, configs.cache)) {
+			fprintf(stderr, "No memory for meta cache\n");
+			return -1;
+		}
+	}
+
+	//最后在线时间定时写入数据库
+	if(configs.database[0]) {
+		if(rc = uv_timer_init(shard->loop, &shard->seen.timer)) {
+			fprintf(stderr, "uv_timer_init failed: %s", uv_strerror(rc));
+			return -1;
+		}
+		if(rc = uv_timer_start(&shard->seen.timer, on_seen, configs.flush*1000, configs.flush*1000)) {
+			fprintf(stderr, "uv_timer_start failed %s\n", uv_strerror(rc));
+			return -1;
+		}
 	}
-	running = true;
 
-	if(size > gc.size()) {
-		size = gc.size();
+	//运行统计
+	if(configs.stats) {
+		if(rc = uv_timer_init(shard->loop, &shard->stats)) {
+			fprintf(stderr, "uv_timer_init failed: %s", uv_strerror(rc));
+			return -1;
+		}
+		if(rc = uv_timer_start(&shard->stats, on_stats, configs.stats*1000, configs.stats*1000)) {
+			fprintf(stderr, "uv_timer_start failed %s\n", uv_strerror(rc));
+			return -1;
+		}
+		//事件轮询延迟采样
+		shard->probe.last = uv_hrtime();
+		if(rc = uv_timer_init(shard->loop, &shard->probe.timer)) {
+			fprintf(stderr, "uv_timer_init failed: %s", uv_strerror(rc));
+			return -1;
+		}
+		if(rc = uv_timer_start(&shard->probe.timer, on_probe, PROBE_INTERVAL, PROBE_INTERVAL)) {
+			fprintf(stderr, "uv_timer_start failed %s\n", uv_strerror(rc));
+			return -1;
+		}
 	}
 
-	if(size == 0) {
-		size = gc.size();
-		running = false;
+	return 0;
+}
+
+/**
+  * @brief  关闭事件轮询中的句柄，客户端按断开处理，收件队列保留到所有事件轮询停止后关闭
+  */
+static void on_stop_walk(uv_handle_t *handle, void *arg) {
+	uni_shard *shard = (uni_shard *)arg;
+
+	if(uv_is_closing(handle) || (handle == (uv_handle_t *)&shard->async) || (handle == (uv_handle_t *)&shard->pipe)) {
+		return;
+	}
+	if((handle->type == UV_TCP) && (handle != (uv_handle_t *)&shard->server)) {
+		client_close((uni_client *)handle);
 		return;
 	}
+	uv_close(handle, (uv_close_cb)0);
+}
 
-	if(uv_mutex_trylock(&runs.lock) != 0) {
-		size = gc.size();
-		running = false;
+/**
+  * @brief  停止事件轮询：不再接受连接，关闭所有客户端和定时器，上行队列未写完的报文放回暂存队列
+  *         所有句柄关闭、工作线程的回调全部完成后 uv_run 返回
+  */
+static void shard_stop(uni_shard *shard) {
+	if(shard->stopping) {
 		return;
 	}
+	shard->stopping = 1;
+
+	//写入未写入的最后在线时间，之后关闭客户端，不再产生上行报文
+	seen_flush(shard);
+	uv_walk(shard->loop, on_stop_walk, shard);
+	//不等待上行确认写完，与上行断开相同处理，由 store_close 写入暂存文件
+	pipe_lost(shard);
+	//收件队列不阻止事件轮询退出，其它事件轮询仍可发送消息
+	if(configs.loops > 1) {
+		uv_unref((uv_handle_t *)&shard->async);
+	}
+}
+
+/**
+  * @brief  事件轮询线程
+  */
+static void shard_run(void *arg) {
+	uv_run(((uni_shard *)arg)->loop, UV_RUN_DEFAULT);
+}
+
+/**
+  * @brief  所有事件轮询停止后关闭收件队列，丢弃未处理的消息
+  */
+static void shard_drain(uni_shard *shard) {
+	uni_message *list;
+
+	if(configs.loops > 1) {
+		list = __atomic_exchange_n(&shard->inbox, (uni_message *)0, __ATOMIC_ACQUIRE);
+		while(list) {
+			uni_message *msg = list;
+			list = list->next;
+			free(msg);
+		}
+		uv_close((uv_handle_t *)&shard->async, (uv_close_cb)0);
+	}
+	uv_run(shard->loop, UV_RUN_DEFAULT);
+}
+
+/**
+  * @brief  释放事件轮询分片，暂存队列已由 store_close 写入暂存文件
+  */
+static void shard_close(uni_shard *shard) {
+	int rc;
 
-	//回收已经关闭的连接
-	for(uint64_t n=0; n<size; n++) {
-		free(gc.front());
-		gc.pop();
+	cache_close(&shard->cache);
+	framer_close(&shard->framer);
+	slab_close(&shard->slab);
+	pool_free(&shard->pool, shard->recv);
+	pool_free(&shard->pool, shard->inq.data);
+	pool_close(&shard->pool);
+	free(shard->table.slots);
+	free(shard->registry.slots);
+	free(shard->outq.ring);
+	free(shard->outq.bufs);
+	free(shard->outq.holds);
+	free(shard->outq.sources);
+	free(shard->runs.defined);
+	if(shard->loop && (rc = uv_loop_close(shard->loop))) {
+		fprintf(stderr, "uv_loop_close failed %s\n", uv_strerror(rc));
+	}
+	if(shard->index && shard->loop) {
+		free(shard->loop);
 	}
+}
+
 
-	size = gc.size();
-	uv_mutex_unlock(&runs.lock);
 
-	running = false;
+/**
+  * @brief  收到退出信号，停止所有事件轮询，之后释放资源 (未发送的暂存报文写入暂存文件)
+  */
+static void on_signal(uv_signal_t *handle, int signum) {
+	for(unsigned int n=1; n<configs.loops; n++) {
+		uni_message *msg = message_new(MSG_STOP, "", 0, (const char *)0, 0);
+		if(msg) {
+			shard_post(n, msg);
+		}
+	}
+	shard_stop(shard_of(handle));
 }
 
 
 
 /**
-  * @brief  参数列表 -> 监听端口 上行管道名 超时秒数 注册脚本 心跳脚本
+  * @brief  参数列表 -> 监听端口 上行管道名 超时秒数 注册脚本 心跳脚本 [可选参数]
   * .\gather.exe 4056 echo 300 script/register.lua script/heartbeat.lua
   * ./gather 4056 echo 300 script/register.lua script/heartbeat.lua
+  * ./gather 4056 echo 300 script/register.lua script/heartbeat.lua framing=delimiter:00
+  *
+  * 可选参数
+  *   framing=raw|length:<offset>:<width>[:<adjust>][:le]|delimiter:<hex>|script:<file>|dlms|dlt
+  *   clients=<n>                          预分配的客户端数量
+  *   stats=<seconds>                      定时输出运行统计
+  *   loops=<n>                            事件轮询线程数量，各自以 SO_REUSEPORT 监听同一端口
+  *   watermark=<high>[:<low>]             上行管道待发送数据的高/低水位 (KiB)，超过高水位暂停读取流量大的客户端
+  *   spool=<MiB>                          上行不可用时暂存文件的上限，0 只在内存中暂存
+  *   replay=<KiB/s>                       上行恢复后发送暂存报文的速率
+  *   database=<file>                      注册 心跳 错误 断开事件写入的数据库，为空时不写数据库
+  *   commit=<ms>                          数据库批量提交的间隔
+  *   flush=<seconds>                      心跳更新的最后在线时间写入数据库的间隔
+  *   cache=<n>                            每个事件轮询缓存的不在线客户端状态数量，0 不查询数据库
+  *   retain=<days>                        事件按天分表保存的天数，过期的分表整表删除，0 全部保留
   */
 int main(int argc, char **argv) {
-	struct sockaddr_in addr;
-	uv_tcp_t server;
-	uv_pipe_t client;
-	uv_timer_t timer;
-	uv_connect_t connection;
-	char sock[128];
 	FILE *fp;
 	int rc;
 
 	memset((void *)&configs, 0, sizeof(configs));
-	memset((void *)&runs, 0, sizeof(runs));
-
-	//创建事件轮询
-	loop = uv_default_loop();
+	configs.loops = 1;
+	configs.high_watermark = DEFAULT_HIGH_WATERMARK;
+	configs.low_watermark = DEFAULT_LOW_WATERMARK;
+	configs.spool_size = DEFAULT_SPOOL_SIZE;
+	configs.replay_rate = DEFAULT_REPLAY_RATE;
+	configs.commit = DEFAULT_DB_INTERVAL;
+	configs.flush = DEFAULT_SEEN_INTERVAL;
+	configs.cache = DEFAULT_CACHE_SIZE;
+	configs.retain = DEFAULT_RETAIN_DAYS;
 
 	//判断参数有效性
-	if(argc != 5) {
+	if(argc < 6) {
 		fprintf(stderr, "Invalid parameter amount\n");
 		return 0;
 	}
@@ -592,23 +4747,19 @@ int main(int argc, char **argv) {
 	}
 
 	//管道
-	if(rc = uv_pipe_init(loop, &client, 0)) {
-		fprintf(stderr, "uv_pipe_init failed %s\n", uv_strerror(rc));
+	if((strlen(argv[2]) <= 0) || ((strlen(argv[2]) + 64) > sizeof(configs.sock))) {
+		fprintf(stderr, "Invalid parameter : sock\n");
 		return 1;
 	}
-	else {
-		if((strlen(argv[2]) <= 0) || ((strlen(argv[2]) + 64) > sizeof(sock))) {
-			fprintf(stderr, "Invalid parameter : sock\n");
-		}
-
-		memset(sock, 0, sizeof(sock));
 #if defined(WIN32)
-		sprintf(sock, "\\\\?\\pipe\\%s.gather", argv[2]);
+	sprintf(configs.sock, "\\\\?\\pipe\\%s.gather", argv[2]);
+	sprintf(configs.spool, "%s.spool", argv[2]);
+	sprintf(configs.database, "%s.db", argv[2]);
 #else
-		sprintf(sock, "/tmp/%s.gather", argv[2]);
+	sprintf(configs.sock, "/tmp/%s.gather", argv[2]);
+	sprintf(configs.spool, "/tmp/%s.spool", argv[2]);
+	sprintf(configs.database, "/tmp/%s.db", argv[2]);
 #endif
-		uv_pipe_connect(&connection, &client, (const char *)sock, on_pipe_connect);
-	}
 
 	//超时时间
 	configs.timeout = atoi(argv[3]);
@@ -665,54 +4816,185 @@ int main(int argc, char **argv) {
 		return 1;
 	}
 
-	//初始化TCP服务
-	if(rc = uv_tcp_init(loop, &server)) {
-		fprintf(stderr, "uv_tcp_init failed: %s", uv_strerror(rc));
+	//可选参数 name=value
+	for(int n=6; n<argc; n++) {
+		if(strncmp(argv[n], "framing=", 8) == 0) {
+			if(strlen(argv[n] + 8) >= sizeof(configs.framing)) {
+				fprintf(stderr, "Invalid parameter : framing\n");
+				return 1;
+			}
+			strcpy(configs.framing, argv[n] + 8);
+		}
+		else if(strncmp(argv[n], "clients=", 8) == 0) {
+			configs.max_clients = strtoul(argv[n] + 8, (char **)0, 10);
+		}
+		else if(strncmp(argv[n], "stats=", 6) == 0) {
+			configs.stats = atoi(argv[n] + 6);
+		}
+		else if(strncmp(argv[n], "loops=", 6) == 0) {
+			configs.loops = atoi(argv[n] + 6);
+			if((configs.loops < 1) || (configs.loops > 256)) {
+				fprintf(stderr, "Invalid parameter : loops\n");
+				return 1;
+			}
+#if !defined(SO_REUSEPORT)
+			if(configs.loops > 1) {
+				fprintf(stderr, "Invalid parameter : loops, SO_REUSEPORT not supported\n");
+				return 1;
+			}
+#endif
+		}
+		else if(strncmp(argv[n], "spool=", 6) == 0) {
+			configs.spool_size = (uint64_t)strtoul(argv[n] + 6, (char **)0, 10) * 1024 * 1024;
+		}
+		else if(strncmp(argv[n], "replay=", 7) == 0) {
+			configs.replay_rate = strtoul(argv[n] + 7, (char **)0, 10) * 1024;
+			if(configs.replay_rate < (1000 / STORE_INTERVAL)) {
+				fprintf(stderr, "Invalid parameter : replay\n");
+				return 1;
+			}
+		}
+		else if(strncmp(argv[n], "database=", 9) == 0) {
+			if(strlen(argv[n] + 9) >= sizeof(configs.database)) {
+				fprintf(stderr, "Invalid parameter : database\n");
+				return 1;
+			}
+			strcpy(configs.database, argv[n] + 9);
+		}
+		else if(strncmp(argv[n], "commit=", 7) == 0) {
+			configs.commit = atoi(argv[n] + 7);
+			if((configs.commit <= 0) || (configs.commit > 60000)) {
+				fprintf(stderr, "Invalid parameter : commit\n");
+				return 1;
+			}
+		}
+		else if(strncmp(argv[n], "flush=", 6) == 0) {
+			configs.flush = atoi(argv[n] + 6);
+			if((configs.flush <= 0) || (configs.flush > 3600)) {
+				fprintf(stderr, "Invalid parameter : flush\n");
+				return 1;
+			}
+		}
+		else if(strncmp(argv[n], "cache=", 6) == 0) {
+			configs.cache = strtoul(argv[n] + 6, (char **)0, 10);
+		}
+		else if(strncmp(argv[n], "retain=", 7) == 0) {
+			configs.retain = atoi(argv[n] + 7);
+			if(configs.retain > 36500) {
+				fprintf(stderr, "Invalid parameter : retain\n");
+				return 1;
+			}
+		}
+		else if(strncmp(argv[n], "watermark=", 10) == 0) {
+			char *end;
+			configs.high_watermark = strtoul(argv[n] + 10, &end, 10) * 1024;
+			configs.low_watermark = (*end == ':') ? (strtoul(end + 1, (char **)0, 10) * 1024) : (configs.high_watermark / 4);
+			if(!configs.high_watermark || (configs.low_watermark >= configs.high_watermark)) {
+				fprintf(stderr, "Invalid parameter : watermark\n");
+				return 1;
+			}
+		}
+		else {
+			fprintf(stderr, "Invalid parameter : %s\n", argv[n]);
+			return 1;
+		}
+	}
+
+	//检查分帧参数
+	uni_framer framer;
+	if(framer_open(&framer, configs.framing)) {
+		fprintf(stderr, "Invalid parameter : framing\n");
 		return 1;
 	}
+	framer_close(&framer);
 
-	//初始化TIMER服务
-	if(rc = uv_timer_init(loop, &timer)) {
-		fprintf(stderr, "uv_timer_init failed: %s", uv_strerror(rc));
+	//检查脚本
+	if(vm_check(configs.script_registered, "=register") || vm_check(configs.script_heartbeat, "=heartbeat")) {
 		return 1;
 	}
 
-	//设置监听IP和PORT
-	if(rc = uv_ip4_addr("0.0.0.0", configs.port, &addr)) {
-		fprintf(stderr, "uv_ip4_addr failed: %s", uv_strerror(rc));
+	//初始化工作线程虚拟机
+	if((rc = uv_key_create(&vm_key))) {
+		fprintf(stderr, "uv_key_create failed %s\n", uv_strerror(rc));
 		return 1;
 	}
-	if(rc = uv_tcp_bind(&server, (const struct sockaddr *)&addr, 0)) {
-		fprintf(stderr, "uv_tcp_bind failed: %s", uv_strerror(rc));
+	if((rc = uv_mutex_init(&vm_lock))) {
+		fprintf(stderr, "uv_mutex_init failed %s\n", uv_strerror(rc));
 		return 1;
 	}
 
-	//开始监听
-	if(rc = uv_listen((uv_stream_t *)&server, DEFAULT_BACKLOG, on_new_connection)) {
-		fprintf(stderr, "uv_listen failed %s\n", uv_strerror(rc));
+	//数据库写线程
+	if(db_open(configs.database, configs.commit, configs.retain)) {
 		return 1;
 	}
 
-	//启动TIMER服务
-	if(rc = uv_timer_start(&timer, on_timer_triggered, 30*1000, (30*1000-100))) {
-		fprintf(stderr, "uv_timer_start failed %s\n", uv_strerror(rc));
+	//上次运行保存的登录帧，分帧方式与注册脚本均相同时才有效
+	configs.profile = known_hash(configs.framing, strlen(configs.framing)) ^ \
+	(known_hash(configs.script_registered, strlen(configs.script_registered)) * 16777619U);
+	if(known_init()) {
+		fprintf(stderr, "No memory for known logins\n");
 		return 1;
 	}
 
-	//初始化互斥量
-	if(rc = uv_mutex_init(&runs.lock)) {
-		fprintf(stderr, "uv_mutex_init failed %s\n", uv_strerror(rc));
+	//客户端名称表
+	if(intern_init()) {
+		fprintf(stderr, "No memory for name table\n");
 		return 1;
 	}
 
-	//开始事件轮询
-	if((rc = uv_run(loop, UV_RUN_DEFAULT))) {
-		uv_mutex_destroy(&runs.lock);
-		fprintf(stderr, "uv_run failed %s\n", uv_strerror(rc));
+	//上次运行时事件轮询更多，多出的暂存文件合并到现有的暂存文件
+	store_collect();
+
+	//初始化事件轮询分片，第一个分片使用默认事件轮询并在主线程运行
+	shards = (uni_shard *)calloc(configs.loops, sizeof(uni_shard));
+	if(!shards) {
+		fprintf(stderr, "No memory for shards\n");
 		return 1;
 	}
+	for(unsigned int n=0; n<configs.loops; n++) {
+		if(shard_open(&shards[n], n)) {
+			return 1;
+		}
+	}
+
+	//退出信号
+	uv_signal_init(shards[0].loop, &signals[0]);
+	uv_signal_start(&signals[0], on_signal, SIGINT);
+	uv_signal_init(shards[0].loop, &signals[1]);
+	uv_signal_start(&signals[1], on_signal, SIGTERM);
+
+	//其它分片各自一个线程
+	for(unsigned int n=1; n<configs.loops; n++) {
+		if((rc = uv_thread_create(&shards[n].thread, shard_run, &shards[n]))) {
+			fprintf(stderr, "uv_thread_create failed %s\n", uv_strerror(rc));
+			return 1;
+		}
+	}
+
+	//开始事件轮询，收到退出信号后关闭所有句柄，工作线程的回调全部完成后返回
+	uv_run(shards[0].loop, UV_RUN_DEFAULT);
+	for(unsigned int n=1; n<configs.loops; n++) {
+		uv_thread_join(&shards[n].thread);
+	}
+	for(unsigned int n=0; n<configs.loops; n++) {
+		shard_drain(&shards[n]);
+	}
+
+	//事件轮询均已停止，未发送的报文写入暂存文件，之后写入剩余的事件
+	for(unsigned int n=0; n<configs.loops; n++) {
+		store_close(&shards[n]);
+	}
+	db_close();
 
-	uv_mutex_destroy(&runs.lock);
+	vm_close_all();
+	uv_mutex_destroy(&vm_lock);
+	uv_key_delete(&vm_key);
+	for(unsigned int n=0; n<configs.loops; n++) {
+		shard_close(&shards[n]);
+	}
+	free(shards);
+	intern_close();
+	known_close();
 
 	return 0;
 }
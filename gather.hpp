@@ -1,7 +1,26 @@
 #ifndef __GATHER_HPP__
 #define __GATHER_HPP__
 
+#include <stddef.h>
 #include <stdint.h>
+#include <string.h>
+
+#define PACKET_MAGIC		0xA5
+#define PACKET_VERSION		1
+#define PACKET_VERSION_2	2
+#define PACKET_MAX_SIZE		(1024*1024)
+#define PACKET_V2_SIZE		18
+#define PACKET_HEAD_MAX		64
+#define PACKET_HANDLE		0x01
+#define PACKET_DEFINE		0x02
+#define PACKET_HANDLE_BITS	24
+#define PACKET_HANDLE_MAX	(1 << PACKET_HANDLE_BITS)
+
+/**
+  * @brief  句柄低 24 位为编号 (小于 PACKET_HANDLE_MAX)，高 8 位为编号被复用的代数 (取低 8 位)
+  */
+#define PACKET_HANDLE_INDEX(handle)				((uint32_t)(handle) & (PACKET_HANDLE_MAX - 1))
+#define PACKET_HANDLE_MAKE(index, generation)	((uint32_t)(index) | ((uint32_t)(generation) << PACKET_HANDLE_BITS))
 
 /**
   * @brief  标识
@@ -13,8 +32,10 @@ enum __flags {
 	
 	RE_OK,//成功
 	RE_ONLINE,//在线
-	RE_OFFLINE,//不在线
+	RE_OFFLINE,//不在线，数据库中有记录时数据为 packet_meta
 	RE_FAILD,//失败
+	
+	PH_HELLO,//协商包头版本，数据为发送方支持的最高版本 (1字节)
 };
 
 /**
@@ -26,4 +47,154 @@ typedef struct __packet_header {
 	uint8_t flag;
 } packet_header;
 
+/**
+  * @brief  前缀，管道为字节流，每个包以前缀开始
+  *         magic | version | reserved | length (之后的包头与数据的字节数，本机字节序)
+  */
+typedef struct __packet_prefix {
+	uint8_t magic;
+	uint8_t version;
+	uint16_t reserved;
+	uint32_t length;
+} packet_prefix;
+
+/**
+  * @brief  不在线客户端的最后状态 (本机字节序)，随 RE_OFFLINE 返回
+  */
+typedef struct __packet_meta {
+	int64_t seen;//最后在线时间 (UNIX 秒)
+	uint8_t ip[4];//最后连接的地址
+	uint16_t port;//最后连接的端口
+	uint16_t reserved;
+} packet_meta;
+
+/**
+  * @brief  计算字节流中首个包的长度 (含前缀)
+  * @retval >0 包长度 (可能大于已有数据)，0 数据不足，<0 不是有效的包，字节流无法继续解析
+  */
+static inline long packet_measure(const void *data, size_t size) {
+	packet_prefix prefix;
+
+	if(size < sizeof(prefix)) {
+		return 0;
+	}
+	memcpy(&prefix, data, sizeof(prefix));
+	if(prefix.magic != PACKET_MAGIC) {
+		return -1;
+	}
+	if((prefix.version == PACKET_VERSION) && (prefix.length < sizeof(packet_header))) {
+		return -1;
+	}
+	if((prefix.version == PACKET_VERSION_2) && (prefix.length < (PACKET_V2_SIZE + 1))) {
+		return -1;
+	}
+	if(((prefix.version != PACKET_VERSION) && (prefix.version != PACKET_VERSION_2)) || (prefix.length > PACKET_MAX_SIZE)) {
+		return -1;
+	}
+
+	return (long)(sizeof(prefix) + prefix.length);
+}
+
+/**
+  * @brief  v2 包头，紧随前缀，无填充
+  *         seq(8) | timestamp(8) | flag(1) | options(1) | [句柄(4)] | [名称长度(varint) + 名称] | 数据
+  *         seq 为发送方单调递增序号，timestamp 为接收时间 (纳秒，UNIX 时间)，
+  *         options 含 PACKET_HANDLE 时以句柄代替名称，同时含 PACKET_DEFINE 时句柄后附名称，
+  *         接收方记录该连接上句柄与名称的对应关系，之后同一句柄不再附名称
+  *         句柄仅在 PH_HELLO 数据第2字节含 PACKET_HANDLE 的对端之间使用，编号被复用时代数改变并重新附名称，
+  *         接收方按 PACKET_HANDLE_INDEX 记录完整的句柄；下行只带句柄时须与最近一次附名称的句柄相同，否则被丢弃
+  */
+typedef struct __packet_v2 {
+	uint64_t seq;
+	uint64_t timestamp;
+	uint8_t flag;
+	uint8_t options;
+	uint32_t handle;
+	const char *name;
+	size_t name_size;
+	const char *data;
+	size_t size;
+} packet_v2;
+
+/**
+  * @brief  编码 v2 前缀与包头 (不含数据)，head 至少 PACKET_HEAD_MAX 字节
+  * @retval 前缀与包头的字节数
+  */
+static inline size_t packet_v2_encode(char *head, const packet_v2 *packet) {
+	packet_prefix prefix;
+	size_t n = sizeof(prefix);
+
+	memcpy(head + n, &packet->seq, 8);
+	memcpy(head + n + 8, &packet->timestamp, 8);
+	head[n + 16] = (char)packet->flag;
+	head[n + 17] = (char)packet->options;
+	n += PACKET_V2_SIZE;
+	if(packet->options & PACKET_HANDLE) {
+		memcpy(head + n, &packet->handle, 4);
+		n += 4;
+	}
+	if(!(packet->options & PACKET_HANDLE) || (packet->options & PACKET_DEFINE)) {
+		size_t length = (packet->name_size < 32) ? packet->name_size : 31;
+		head[n++] = (char)length;
+		memcpy(head + n, packet->name, length);
+		n += length;
+	}
+
+	prefix.magic = PACKET_MAGIC;
+	prefix.version = PACKET_VERSION_2;
+	prefix.reserved = 0;
+	prefix.length = (uint32_t)(n - sizeof(prefix) + packet->size);
+	memcpy(head, &prefix, sizeof(prefix));
+
+	return n;
+}
+
+/**
+  * @brief  解析 v2 包头，packet 指向前缀之后，size 为前缀中的长度
+  * @retval 0 成功，<0 格式错误
+  */
+static inline int packet_v2_decode(const char *packet, size_t size, packet_v2 *out) {
+	size_t n = PACKET_V2_SIZE;
+	size_t length = 0;
+	unsigned int shift = 0;
+
+	if(size < (PACKET_V2_SIZE + 1)) {
+		return -1;
+	}
+	memcpy(&out->seq, packet, 8);
+	memcpy(&out->timestamp, packet + 8, 8);
+	out->flag = (uint8_t)packet[16];
+	out->options = (uint8_t)packet[17];
+	out->handle = 0;
+	out->name = (const char *)0;
+	out->name_size = 0;
+	if(out->options & PACKET_HANDLE) {
+		if((n + 4) > size) {
+			return -1;
+		}
+		memcpy(&out->handle, packet + n, 4);
+		n += 4;
+	}
+	if(!(out->options & PACKET_HANDLE) || (out->options & PACKET_DEFINE)) {
+		//名称长度为 varint (LEB128)
+		do {
+			if((n >= size) || (shift > 28)) {
+				return -1;
+			}
+			length |= (size_t)(packet[n] & 0x7F) << shift;
+			shift += 7;
+		} while(packet[n++] & 0x80);
+		if((n + length) > size) {
+			return -1;
+		}
+		out->name = packet + n;
+		out->name_size = length;
+		n += length;
+	}
+	out->data = packet + n;
+	out->size = size - n;
+
+	return 0;
+}
+
 #endif
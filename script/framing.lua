@@ -0,0 +1,17 @@
+--lua script language
+--framing script, loaded once and called on the event loop thread
+--argument: packet, the buffered bytes of one connection (may hold several or partial frames)
+--return: frame length, 0 when more bytes are needed, -n to discard n leading bytes
+
+--frames terminated by a zero byte
+return function(packet)
+	for i = 1, packet:len()
+	do
+		if(packet:byte(i) == 0)
+		then
+			return i
+		end
+	end
+
+	return 0
+end
@@ -1,28 +1,18 @@
 --lua script language
 --variables: client packet
+--client: string
+--packet: len() byte(i [, j]) sub(i [, j]) u16(i [, little]) u32(i [, little])
 
 print(os.date().."  heartbeat script")
 
---client name
-local name = ""
-for i,v in ipairs(client)
-do
-	name = name..string.char(v)
-end
-
---packet received from client
-local comp = ""
-for i,v in ipairs(packet)
-do
-	comp = comp..string.char(v)
-end
+--packet received from client, trailing zeros ignored
+local comp = string.gsub(packet:sub(1), "%z+$", "")
 
 --confirm the heartbeat
-if(name == comp)
+if(client == comp)
 then
 	print("heartbeat packet")
 	return true
 else
 	return false
 end
-
@@ -1,16 +1,12 @@
 --lua script language
 --variables: packet
+--packet: len() byte(i [, j]) sub(i [, j]) u16(i [, little]) u32(i [, little])
 
 print(os.date().."  register script")
 
 --packet received from client
-name = ""
-for i,v in ipairs(packet)
-do
-	name = name..string.char(v)
-end
+local name = packet:sub(1)
 
 print("Registered name is: "..name)
 
 return name
-
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <uv.h>
 #include "sqlite3.h"
 #include "gather.hpp"
@@ -13,6 +14,9 @@
 
 uv_loop_t *loop;
 
+//读取回调中数据不会保留到回调之外，所有连接共用一块接收缓冲区
+static char scratch[64*1024];
+
 typedef struct {
 	uv_write_t req;
 	uv_buf_t buf;
@@ -25,8 +29,8 @@ void free_write_req(uv_write_t *req) {
 }
 
 void alloc_buffer(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
-	buf->base = (char *)malloc(suggested_size);
-	buf->len = suggested_size;
+	buf->base = scratch;
+	buf->len = sizeof(scratch);
 }
 
 void echo_write(uv_write_t *req, int status) {
@@ -36,46 +40,242 @@ void echo_write(uv_write_t *req, int status) {
 	free_write_req(req);
 }
 
-void echo_read(uv_stream_t *client, ssize_t nread, const uv_buf_t *buf) {
-	if (nread > 0) {
+/**
+  * 每个连接保留上次读取残留的半包
+  */
+typedef struct {
+	uv_pipe_t handle;
+	char *pending;
+	size_t size;
+	size_t capacity;
+	unsigned int version;
+	uint64_t seq;
+	char (*names)[32];
+	uint32_t *handles;
+	uint32_t count;
+} conn_t;
+
+void on_close(uv_handle_t *handle) {
+	conn_t *conn = (conn_t *)handle;
+	free(conn->pending);
+	free(conn->names);
+	free(conn->handles);
+	free(conn);
+}
+
+/**
+  * 以连接协商的版本发送一个包
+  */
+void echo_send(conn_t *conn, const char *name, uint8_t flag, const char *data, size_t size) {
+	char head[PACKET_HEAD_MAX];
+	size_t length;
+	write_req_t *req = (write_req_t*) malloc(sizeof(write_req_t));
+	if(!req) {
+		return;
+	}
+
+	if(conn->version == PACKET_VERSION_2) {
+		packet_v2 packet;
+		uv_timeval64_t tv;
+		uv_gettimeofday(&tv);
+		packet.seq = ++conn->seq;
+		packet.timestamp = (uint64_t)tv.tv_sec * 1000000000ULL + (uint64_t)tv.tv_usec * 1000ULL;
+		packet.flag = flag;
+		packet.options = 0;
+		packet.name = name;
+		packet.name_size = strlen(name);
+		packet.size = size;
+		length = packet_v2_encode(head, &packet);
+	}
+	else {
+		packet_prefix prefix;
 		packet_header header;
-		
-		if(nread < sizeof(header)) {
+		memset(&header, 0, sizeof(header));
+		header.id = time(NULL);
+		strncpy(header.name, name, sizeof(header.name) - 1);
+		header.flag = flag;
+		prefix.magic = PACKET_MAGIC;
+		prefix.version = PACKET_VERSION;
+		prefix.reserved = 0;
+		prefix.length = (uint32_t)(sizeof(header) + size);
+		memcpy(head, &prefix, sizeof(prefix));
+		memcpy(head + sizeof(prefix), &header, sizeof(header));
+		length = sizeof(prefix) + sizeof(header);
+	}
+
+	req->buf.len = length + size;
+	req->buf.base = (char *)malloc(req->buf.len);
+	if(!req->buf.base) {
+		free(req);
+		return;
+	}
+	memcpy(req->buf.base, head, length);
+	memcpy(req->buf.base + length, data, size);
+	uv_write((uv_write_t *)req, (uv_stream_t *)conn, &req->buf, 1, echo_write);
+}
+
+void echo_packet(conn_t *conn, unsigned int version, const char *packet, size_t size) {
+	char name[32];
+	uint8_t flag;
+	const char *data;
+
+	if(version == PACKET_VERSION_2) {
+		packet_v2 header;
+		uv_timeval64_t tv;
+		if(packet_v2_decode(packet, size, &header) || (header.name_size >= sizeof(name))) {
+			fprintf(stderr, "Invalid packet header\n");
 			return;
 		}
+		if(header.name) {
+			memcpy(name, header.name, header.name_size);
+			name[header.name_size] = 0;
+		}
+		else {
+			name[0] = 0;
+		}
+		//记录或查询句柄对应的名称，按编号保存完整的句柄 (含代数)
+		if(header.options & PACKET_HANDLE) {
+			uint32_t index = PACKET_HANDLE_INDEX(header.handle);
+			if(index >= conn->count) {
+				uint32_t count = conn->count ? conn->count : 1024;
+				while(index >= count) {
+					count <<= 1;
+				}
+				char (*names)[32] = (char (*)[32])realloc(conn->names, count * sizeof(*names));
+				if(!names) {
+					return;
+				}
+				conn->names = names;
+				uint32_t *handles = (uint32_t *)realloc(conn->handles, count * sizeof(*handles));
+				if(!handles) {
+					return;
+				}
+				memset(names + conn->count, 0, (count - conn->count) * sizeof(*names));
+				memset(handles + conn->count, 0, (count - conn->count) * sizeof(*handles));
+				conn->handles = handles;
+				conn->count = count;
+			}
+			if(header.options & PACKET_DEFINE) {
+				strcpy(conn->names[index], name);
+				conn->handles[index] = header.handle;
+			}
+			else if(conn->names[index][0] && (conn->handles[index] == header.handle)) {
+				strcpy(name, conn->names[index]);
+			}
+			else {
+				fprintf(stderr, "Unknown packet handle %08x\n", (unsigned int)header.handle);
+				return;
+			}
+		}
+		flag = header.flag;
+		data = header.data;
+		size = header.size;
+
+		//打印包头信息，含接收到此处的延迟
+		uv_gettimeofday(&tv);
+		fprintf(stdout, "Client: %s SEQ: %llu FLAG: %02x DELAY: %lldus.", name, (unsigned long long)header.seq, flag, \
+		(long long)(((int64_t)tv.tv_sec * 1000000000LL + (int64_t)tv.tv_usec * 1000LL - (int64_t)header.timestamp) / 1000));
+	}
+	else {
+		packet_header header;
+		memcpy(&header, packet, sizeof(header));
+		memcpy(name, header.name, sizeof(name));
+		name[sizeof(name) - 1] = 0;
+		flag = header.flag;
+		data = packet + sizeof(header);
+		size -= sizeof(header);
 
 		//打印包头信息
-		memset(&header, 0, sizeof(header));
-		memcpy(&header, buf->base, sizeof(header));
-		fprintf(stdout, "Client: %s ID: %08x FLAG: %02x.", header.name, header.id, header.flag);
+		fprintf(stdout, "Client: %s ID: %08x FLAG: %02x.", name, (unsigned int)header.id, flag);
+	}
+
+	//打印包内容
+	if(size > 0) {
+		fprintf(stdout, " Message: %.*s", (int)size, data);
+	}
+	fprintf(stdout, "\n");
 
-		//打印包内容
-		if(nread > sizeof(header)) {
-			fprintf(stdout, " Message: %s", &((char *)(buf->base))[sizeof(header)]);
+	//协商版本，先以 v1 回复支持的最高版本与选项
+	if(flag == PH_HELLO) {
+		uint8_t supported[2] = {PACKET_VERSION_2, PACKET_HANDLE};
+		echo_send(conn, "", PH_HELLO, (const char *)supported, sizeof(supported));
+		if((size > 0) && ((uint8_t)data[0] >= PACKET_VERSION_2)) {
+			conn->version = PACKET_VERSION_2;
 		}
+	}
+	//如果是透传，则返回确认报文
+	else if(flag == PH_TRANSMIT) {
+		echo_send(conn, name, PH_TRANSMIT, "Server received.", strlen("Server received.") + 1);
+	}
+}
 
-		//如果是透传，则返回确认报文
-		if(header.flag == PH_TRANSMIT) {
-			write_req_t *req = (write_req_t*) malloc(sizeof(write_req_t));
-			req->buf.len = sizeof(header) + strlen("Server received.") + 1;
-			req->buf.base = (char *)malloc(req->buf.len);
-			if(!req->buf.base) {
-				free(buf->base);
-				return;
+/**
+  * 字节流解析，一次读取中的多个完整包逐个处理，半包保留到下次读取
+  */
+int echo_feed(conn_t *conn, const char *data, size_t size) {
+	const char *cursor = data;
+	size_t remain = size;
+	long n;
+
+	//拼接上次残留的半包
+	if(conn->size) {
+		if((conn->size + size) > conn->capacity) {
+			char *pending = (char *)realloc(conn->pending, conn->size + size);
+			if(!pending) {
+				return -1;
 			}
+			conn->pending = pending;
+			conn->capacity = conn->size + size;
+		}
+		memcpy(conn->pending + conn->size, data, size);
+		conn->size += size;
+		cursor = conn->pending;
+		remain = conn->size;
+	}
+
+	while(remain > 0) {
+		n = packet_measure(cursor, remain);
+		if(n < 0) {
+			return -1;
+		}
+		if((n == 0) || ((size_t)n > remain)) {
+			break;
+		}
+		echo_packet(conn, ((const packet_prefix *)cursor)->version, cursor + sizeof(packet_prefix), (size_t)n - sizeof(packet_prefix));
+		cursor += n;
+		remain -= n;
+	}
 
-			memcpy(req->buf.base, &header, sizeof(header));
-			strcpy(req->buf.base + sizeof(header), "Server received.");
-			uv_write((uv_write_t *)req, client, &req->buf, 1, echo_write);
+	//保存残留的半包
+	if(remain && (cursor != conn->pending)) {
+		if(remain > conn->capacity) {
+			char *pending = (char *)malloc(remain);
+			if(!pending) {
+				return -1;
+			}
+			free(conn->pending);
+			conn->pending = pending;
+			conn->capacity = remain;
+		}
+		memmove(conn->pending, cursor, remain);
+	}
+	conn->size = remain;
+
+	return 0;
+}
+
+void echo_read(uv_stream_t *client, ssize_t nread, const uv_buf_t *buf) {
+	if (nread > 0) {
+		if(echo_feed((conn_t *)client, buf->base, nread)) {
+			fprintf(stderr, "Invalid packet\n");
+			uv_close((uv_handle_t*) client, on_close);
 		}
 	}
 	else if (nread < 0) {
 		if (nread != UV_EOF)
 			fprintf(stderr, "Read error %s\n", uv_err_name(nread));
-		uv_close((uv_handle_t*) client, NULL);
+		uv_close((uv_handle_t*) client, on_close);
 	}
-
-	free(buf->base);
 }
 
 void on_new_connection(uv_stream_t *server, int status) {
@@ -84,14 +284,15 @@ void on_new_connection(uv_stream_t *server, int status) {
 		return;
 	}
 
-	uv_pipe_t *client = (uv_pipe_t*) malloc(sizeof(uv_pipe_t));
-	uv_pipe_init(loop, client, 0);
+	conn_t *client = (conn_t*) calloc(1, sizeof(conn_t));
+	client->version = PACKET_VERSION;
+	uv_pipe_init(loop, &client->handle, 0);
 
 	if (uv_accept(server, (uv_stream_t*)client) == 0) {
 		uv_read_start((uv_stream_t*)client, alloc_buffer, echo_read);
 	}
 	else {
-		uv_close((uv_handle_t*) client, NULL);
+		uv_close((uv_handle_t*) client, on_close);
 	}
 }
 